@@ -0,0 +1,343 @@
+/*Integrates a function adaptively
+
+   features: integrate(f, params, a, b, rule, tolerance, numWorkers, &result)
+             approximates the integral of f(x, params) over [a, b] until the
+             estimated absolute error is at most tolerance.
+
+             Every region of [a, b] is estimated with one rule, which gives a
+             value and an error:
+               SIMPSON   Simpson on the region and on its halves, 5 points,
+                         extrapolated by Richardson
+               KRONROD   Gauss-Kronrod 7-15, 15 points, the error is the
+                         difference to the embedded 7 point Gauss rule
+               ROMBERG   a Romberg table of INTEGRATE_ROMBERGLEVELS rows,
+                         17 points
+
+             The regions are kept in a heap by error. Refinement is global:
+             the regions with the largest error are split until the sum of all
+             errors is below tolerance, so smooth parts are never refined just
+             because a singular part needs it. Each round takes the worst regions
+             (up to INTEGRATE_BATCH per worker, but no more than the error asks
+             for), and the workers estimate their halves in parallel.
+
+             integrate_serial(arena, f, params, a, b, rule, tolerance, &result)
+             does the same on the calling thread with the heap of an arena from
+             integrate_arena_init(), so that a thread integrating many small
+             problems reuses its memory instead of allocating for every one.
+
+   usage:
+     #include "integrate.h"
+     double circle(double x, void *params){ return sqrt(1 - x*x); }
+     ...
+     struct integral result;
+     integrate(circle, NULL, 0, 1, KRONROD, 1e-10, numWorkers, &result);
+
+     compile with -lpthread -lm
+*/
+#ifndef INTEGRATE_H
+#define INTEGRATE_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <math.h>
+
+#ifndef INTEGRATE_BATCH
+#define INTEGRATE_BATCH 16           /* regions split per worker and round at most */
+#endif
+#ifndef INTEGRATE_MAXREGIONS
+#define INTEGRATE_MAXREGIONS 1000000 /* refinement stops when there are this many regions */
+#endif
+#define INTEGRATE_ROMBERGLEVELS 4    /* halvings of the Romberg table */
+#define INTEGRATE_MAXWORKERS 128
+
+typedef double (*integrand)(double x, void *params);
+
+enum integration_rule {SIMPSON, KRONROD, ROMBERG};
+
+//The outcome of integrate()
+struct integral {
+  double value, error;
+  long evaluations, regions;
+  bool converged;              /* error <= tolerance, false if the regions ran out or f isn't finite */
+};
+
+struct region {
+  double a, b, value, error;
+};
+
+//Simpson's rule on the region and on its two halves
+static inline void integrate_simpson(integrand f, void *params, struct region *r){
+  double m = (r->a + r->b)/2, h = r->b - r->a;
+  double fa = f(r->a, params), fm = f(m, params), fb = f(r->b, params);
+  double fl = f((r->a + m)/2, params), fr = f((m + r->b)/2, params);
+  double whole = h/6 * (fa + 4*fm + fb);
+  double halves = h/12 * (fa + 4*fl + 2*fm + 4*fr + fb);
+
+  r->value = halves + (halves - whole)/15;
+  r->error = fabs(halves - whole)/15;
+}
+
+/* Gauss-Kronrod nodes and weights, as in QUADPACK's qk15. The Gauss nodes are the odd
+   Kronrod nodes and the center */
+static const double kronrodNodes[8] = {
+  0.991455371120812639206854697526329, 0.949107912342758524526189684047851,
+  0.864864423359769072789712788640926, 0.741531185599394439863864773280788,
+  0.586087235467691130294144845693013, 0.405845151377397166906606412076961,
+  0.207784955007898467600689403773245, 0.000000000000000000000000000000000
+};
+static const double kronrodWeights[8] = {
+  0.022935322010529224963732008058970, 0.063092092629978553290700663189204,
+  0.104790010322250183839876322541518, 0.140653259715525918745189590510238,
+  0.169004726639267902826583426598550, 0.190350578064785409913256402421014,
+  0.204432940075298892414161999234649, 0.209482141084727828012999174891714
+};
+static const double gaussWeights[4] = {
+  0.129484966168869693270611432679082, 0.279705391489276667901467771423780,
+  0.381830050505118944950369775488975, 0.417959183673469387755102040816327
+};
+
+//Gauss-Kronrod 7-15, the 7 Gauss points are shared with the 15 Kronrod points
+static inline void integrate_kronrod(integrand f, void *params, struct region *r){
+  double center = (r->a + r->b)/2, half = (r->b - r->a)/2;
+  double fc = f(center, params);
+  double kronrod = fc * kronrodWeights[7], gauss = fc * gaussWeights[3];
+
+  for (int j = 0; j < 7; j++) {
+    double dx = half * kronrodNodes[j];
+    double sum = f(center - dx, params) + f(center + dx, params);
+    kronrod += kronrodWeights[j] * sum;
+    if (j % 2 == 1) gauss += gaussWeights[j / 2] * sum;
+  }
+  r->value = kronrod * half;
+  r->error = fabs((kronrod - gauss) * half);
+}
+
+//Romberg: trapezoids of 1, 2, 4, ... panels extrapolated by Richardson
+static inline void integrate_romberg(integrand f, void *params, struct region *r){
+  double table[INTEGRATE_ROMBERGLEVELS + 1][INTEGRATE_ROMBERGLEVELS + 1];
+  double h = r->b - r->a;
+  long panels = 1;
+
+  table[0][0] = h/2 * (f(r->a, params) + f(r->b, params));
+  for (int k = 1; k <= INTEGRATE_ROMBERGLEVELS; k++) {
+    double sum = 0, scale = 4;
+    h /= 2;
+    for (long i = 1; i <= panels; i++) sum += f(r->a + (2*i - 1)*h, params);
+    panels *= 2;
+
+    table[k][0] = table[k - 1][0]/2 + h*sum;
+    for (int j = 1; j <= k; j++, scale *= 4)
+      table[k][j] = table[k][j - 1] + (table[k][j - 1] - table[k - 1][j - 1])/(scale - 1);
+  }
+  r->value = table[INTEGRATE_ROMBERGLEVELS][INTEGRATE_ROMBERGLEVELS];
+  r->error = fabs(r->value - table[INTEGRATE_ROMBERGLEVELS - 1][INTEGRATE_ROMBERGLEVELS - 1]);
+}
+
+static void (*const integrationRules[])(integrand, void *, struct region *) = {
+  integrate_simpson, integrate_kronrod, integrate_romberg
+};
+static const long ruleEvaluations[] = {5, 15, 2 + (1 << INTEGRATE_ROMBERGLEVELS) - 1};
+static const char *const ruleNames[] = {"simpson", "kronrod", "romberg"};
+
+/* The regions as a binary heap with the largest error on top */
+struct region_heap {
+  struct region *regions;
+  long n, size;
+};
+
+static inline void integrate_heap_push(struct region_heap *heap, struct region r){
+  if (heap->n == heap->size) {
+    heap->size = heap->size? 2 * heap->size : 64;
+    heap->regions = realloc(heap->regions, heap->size * sizeof(struct region));
+  }
+  long i = heap->n++;
+  while (i > 0 && heap->regions[(i - 1)/2].error < r.error) {
+    heap->regions[i] = heap->regions[(i - 1)/2];
+    i = (i - 1)/2;
+  }
+  heap->regions[i] = r;
+}
+
+static inline struct region integrate_heap_pop(struct region_heap *heap){
+  struct region top = heap->regions[0], last = heap->regions[--heap->n];
+  long i = 0;
+
+  while (2*i + 1 < heap->n) {
+    long child = 2*i + 1;
+    if (child + 1 < heap->n && heap->regions[child + 1].error > heap->regions[child].error) child++;
+    if (heap->regions[child].error <= last.error) break;
+    heap->regions[i] = heap->regions[child];
+    i = child;
+  }
+  if (heap->n > 0) heap->regions[i] = last;
+  return top;
+}
+
+/* Shared by the workers of one integrate() call. Worker 0 fills children with the halves
+   of the worst regions, all workers estimate an equal strip of them, worker 0 pushes them */
+struct integration {
+  integrand f;
+  void *params;
+  enum integration_rule rule;
+  int numWorkers;
+  struct region *children;
+  long numChildren;
+  bool done;
+  pthread_barrier_t barrier;
+};
+
+struct integration_worker {
+  struct integration *state;
+  long id;
+};
+
+static inline void integrate_strip(struct integration *s, long id){
+  long first = s->numChildren * id / s->numWorkers, last = s->numChildren * (id + 1) / s->numWorkers;
+  for (long i = first; i < last; i++)
+    integrationRules[s->rule](s->f, s->params, &s->children[i]);
+}
+
+static inline void *integrate_worker(void *arg){
+  struct integration_worker *w = arg;
+  struct integration *s = w->state;
+
+  for (;;) {
+    pthread_barrier_wait(&s->barrier);
+    if (s->done) break;
+    integrate_strip(s, w->id);
+    pthread_barrier_wait(&s->barrier);
+  }
+  return NULL;
+}
+
+/* Scratch memory of integrations: the region heap and the halves of a round. It is kept
+   between calls, so that a thread doing many small integrals doesn't allocate for each */
+struct integration_arena {
+  struct region_heap heap;
+  struct region *children;
+  long maxChildren;
+};
+
+static inline void integrate_arena_init(struct integration_arena *arena, int numWorkers){
+  arena->heap = (struct region_heap) {NULL, 0, 0};
+  arena->maxChildren = 2 * INTEGRATE_BATCH * numWorkers;
+  arena->children = malloc(arena->maxChildren * sizeof(struct region));
+}
+
+static inline void integrate_arena_free(struct integration_arena *arena){
+  free(arena->heap.regions);
+  free(arena->children);
+}
+
+//Refine [a, b] until the errors sum to at most tolerance. With more than one worker the
+//halves of every round are estimated by the pool waiting on s->barrier
+static inline void integrate_regions(struct integration *s, struct integration_arena *arena, double a, double b,
+                                     double tolerance, struct integral *result){
+  struct region_heap *heap = &arena->heap;
+  struct region whole = {a, b, 0, 0};
+  double errorSum, doneValue = 0, doneError = 0;
+  long i, evaluations = 1;
+
+  if (b < a) {
+    //The regions are kept with a < b
+    integrate_regions(s, arena, b, a, tolerance, result);
+    result->value = -result->value;
+    return;
+  }
+  s->children = arena->children;
+  heap->n = 0;
+  integrationRules[s->rule](s->f, s->params, &whole);
+  integrate_heap_push(heap, whole);
+  errorSum = whole.error;
+
+  //A region whose error is nan or inf (f is singular at one of its points) can't be refined
+  //away and would stop nothing from being split, so refinement stops unconverged
+  while (isfinite(errorSum) && heap->n > 0 && heap->n < INTEGRATE_MAXREGIONS) {
+    if (!(errorSum > tolerance)) {
+      //The running sum drifts, check it against the regions before stopping
+      errorSum = doneError;
+      for (i = 0; i < heap->n; i++) errorSum += heap->regions[i].error;
+      if (!(errorSum > tolerance)) break;
+    }
+
+    //Split the worst regions, but not the ones the tolerance allows to stay as they are
+    s->numChildren = 0;
+    double remaining = errorSum;
+    while (heap->n > 0 && s->numChildren < arena->maxChildren && remaining > tolerance) {
+      struct region r = integrate_heap_pop(heap);
+      double m = (r.a + r.b)/2;
+      remaining -= r.error;
+      errorSum -= r.error;
+      if (m <= r.a || m >= r.b) {
+        //Too narrow to split, it keeps its error
+        doneValue += r.value;
+        doneError += r.error;
+        errorSum += r.error;
+        continue;
+      }
+      s->children[s->numChildren++] = (struct region) {r.a, m, 0, 0};
+      s->children[s->numChildren++] = (struct region) {m, r.b, 0, 0};
+    }
+    if (s->numChildren == 0) continue;
+
+    if (s->numWorkers > 1) pthread_barrier_wait(&s->barrier);
+    integrate_strip(s, 0);
+    if (s->numWorkers > 1) pthread_barrier_wait(&s->barrier);
+
+    evaluations += s->numChildren;
+    for (i = 0; i < s->numChildren; i++) {
+      integrate_heap_push(heap, s->children[i]);
+      errorSum += s->children[i].error;
+    }
+  }
+
+  result->value = doneValue;
+  result->error = doneError;
+  for (i = 0; i < heap->n; i++) {
+    result->value += heap->regions[i].value;
+    result->error += heap->regions[i].error;
+  }
+  result->evaluations = evaluations * ruleEvaluations[s->rule];
+  result->regions = heap->n;
+  result->converged = result->error <= tolerance;
+}
+
+//Integrate f over [a, b] to an absolute error of tolerance, on numWorkers threads
+static inline void integrate(integrand f, void *params, double a, double b, enum integration_rule rule,
+                             double tolerance, int numWorkers, struct integral *result){
+  pthread_t workers[INTEGRATE_MAXWORKERS];
+  struct integration_worker args[INTEGRATE_MAXWORKERS];
+  struct integration s = {.f = f, .params = params, .rule = rule};
+  struct integration_arena arena;
+  long w;
+
+  if (numWorkers < 1) numWorkers = 1;
+  if (numWorkers > INTEGRATE_MAXWORKERS) numWorkers = INTEGRATE_MAXWORKERS;
+  s.numWorkers = numWorkers;
+  integrate_arena_init(&arena, numWorkers);
+  pthread_barrier_init(&s.barrier, NULL, numWorkers);
+  for (w = 1; w < numWorkers; w++) {
+    args[w] = (struct integration_worker) {&s, w};
+    pthread_create(&workers[w], NULL, integrate_worker, &args[w]);
+  }
+
+  integrate_regions(&s, &arena, a, b, tolerance, result);
+
+  s.done = true;
+  pthread_barrier_wait(&s.barrier);
+  for (w = 1; w < numWorkers; w++)
+    pthread_join(workers[w], NULL);
+  pthread_barrier_destroy(&s.barrier);
+  integrate_arena_free(&arena);
+}
+
+//Integrate f over [a, b] on the calling thread, with the scratch memory of arena. The arena
+//grows to the largest integral it has seen, after that integrals don't allocate
+static inline void integrate_serial(struct integration_arena *arena, integrand f, void *params, double a, double b,
+                                    enum integration_rule rule, double tolerance, struct integral *result){
+  struct integration s = {.f = f, .params = params, .rule = rule, .numWorkers = 1};
+  integrate_regions(&s, arena, a, b, tolerance, result);
+}
+
+#endif
@@ -0,0 +1,375 @@
+/*Reduces the rows of a matrix, shared by the pthreads and the OpenMP matrix summation
+
+   features: the element type of the matrix, picked at compile time, and the
+             matrix itself: rows x cols elements, row i starting at ROW(i) with
+             stride elements from one row to the next.
+
+               allocMatrix(bytes)  maps the matrix on a huge page boundary
+               parseSize(arg)      reads rows and cols from "n" or "rowsxcolumns"
+               randomBits(i)       splitmix64 bits for element i, so the matrix
+                                   doesn't depend on which thread fills it
+               reduceRow(row, n, &result)
+                                   sum, min and max of a row and the first
+                                   position of each, by an SSE4.1, AVX2 or
+                                   AVX-512 kernel for ints and a generic kernel
+                                   for the other types. initReduceRow() picks
+                                   the kernel for the cpu once at startup.
+
+             Integers are summed in 64 bits, floating point values in double with
+             Kahan summation through accumulate().
+
+   usage:
+     #include "matrixReduce.h"
+     parseSize(argv[1]);
+     initReduceRow();
+     matrix = allocMatrix(rows*stride*sizeof(elem_t));
+     ...
+     struct rowresult row;
+     reduceRow(ROW(i), cols, &row);
+*/
+#ifndef MATRIXREDUCE_H
+#define MATRIXREDUCE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <float.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define HUGEPAGESIZE (2*1024*1024)  /* size of a huge page in bytes */
+#define TILE 4096  /* elements of a row reduced before the running min and max are checked */
+#define LANES 16   /* independent partial results per tile, kept in vector registers */
+#define SEED 0x2545f4914f6cdd1dULL  /* seed of the random matrix */
+
+/* element type of the matrix, picked at compile time with -DELEMENT_INT8, -DELEMENT_INT16,
+   -DELEMENT_INT64, -DELEMENT_FLOAT or -DELEMENT_DOUBLE (int32 by default).
+   Integers are summed in 64 bits, floating point values in double with Kahan summation */
+#if defined(ELEMENT_INT8)
+typedef int8_t elem_t;
+typedef int32_t lane_t;   /* type of the partial sums inside a tile, TILE*INT8_MAX fits */
+#define ELEM_MIN INT8_MIN
+#define ELEM_MAX INT8_MAX
+#elif defined(ELEMENT_INT16)
+typedef int16_t elem_t;
+typedef int32_t lane_t;
+#define ELEM_MIN INT16_MIN
+#define ELEM_MAX INT16_MAX
+#elif defined(ELEMENT_INT64)
+typedef int64_t elem_t;
+typedef int64_t lane_t;
+#define ELEM_MIN INT64_MIN
+#define ELEM_MAX INT64_MAX
+#elif defined(ELEMENT_FLOAT)
+typedef float elem_t;
+typedef double lane_t;
+#define ELEM_MIN (-FLT_MAX)
+#define ELEM_MAX FLT_MAX
+#define FLOATING
+#elif defined(ELEMENT_DOUBLE)
+typedef double elem_t;
+typedef double lane_t;
+#define ELEM_MIN (-DBL_MAX)
+#define ELEM_MAX DBL_MAX
+#define FLOATING
+#else
+#define ELEMENT_INT32
+typedef int32_t elem_t;
+typedef int64_t lane_t;
+#define ELEM_MIN INT32_MIN
+#define ELEM_MAX INT32_MAX
+#endif
+
+#ifdef FLOATING
+typedef double acc_t;     /* type of sums */
+typedef double print_t;   /* type values are converted to for printf */
+#define PRINT_FMT "%.10g"
+#else
+typedef int64_t acc_t;
+typedef long long print_t;
+#define PRINT_FMT "%lld"
+#endif
+
+int rows, cols;  /* size of the matrix */
+size_t stride;   /* elements from the start of one row to the next */
+elem_t *matrix; /* matrix, row i starts at ROW(i) */
+#define ROW(i) (matrix + (size_t) (i)*stride)
+
+//splitmix64: a counter based random number generator. Element (i, j) is generated from
+//its own index, so the matrix is the same no matter which or how many threads fill it
+static uint64_t randomBits(uint64_t counter) {
+  uint64_t z = SEED + counter*0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/* allocate the matrix with mmap, rows start on a cache line and the block on a huge page */
+//With EXPLICIT_HUGEPAGES defined we first ask for pages from the hugetlbfs pool, otherwise
+//(or if the pool is empty) we ask the kernel to back the mapping with transparent huge pages
+static void *allocMatrix(size_t bytes) {
+  char *p;
+#ifdef EXPLICIT_HUGEPAGES
+  size_t huge = (bytes + HUGEPAGESIZE - 1) & ~(size_t) (HUGEPAGESIZE - 1);
+  p = mmap(NULL, huge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (p != MAP_FAILED) return p;
+#endif
+  //Map one huge page extra so that the start can be moved to a huge page boundary
+  p = mmap(NULL, bytes + HUGEPAGESIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    printf("ERROR: could not allocate %zu bytes for the matrix\n", bytes);
+    exit(1);
+  }
+  //Unmap what lies before the boundary and after the pages of the matrix, the tail has to
+  //start on a page, so it starts after bytes rounded up to whole pages
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t pages = (bytes + page - 1) / page * page;
+  size_t head = (HUGEPAGESIZE - (uintptr_t) p % HUGEPAGESIZE) % HUGEPAGESIZE;
+  if (head > 0 && munmap(p, head) != 0) perror("munmap");
+  if (munmap(p + head + pages, HUGEPAGESIZE - head) != 0) perror("munmap");
+  p += head;
+  madvise(p, bytes, MADV_HUGEPAGE);
+  return p;
+}
+
+//Read "size" or "rowsxcolumns" from the command line
+static void parseSize(const char *arg) {
+  char *end;
+  rows = cols = strtol(arg, &end, 10);
+  if (*end == 'x') cols = strtol(end + 1, &end, 10);
+  if (*end != '\0' || rows < 1 || cols < 1) {
+    printf("ERROR: matrix size must be a number or rowsxcolumns, e.g. 5000x20000\n");
+    exit(1);
+  }
+}
+
+/* a value and where in the matrix it was found */
+struct position {
+  elem_t value;
+  int xPos;
+  int yPos;
+};
+
+/* result of reducing one row: the sum and the first position of the min and max */
+struct rowresult {
+  acc_t sum;
+  elem_t min, max;
+  int minPos, maxPos;
+};
+
+/* a running sum. For floating point elements the rounding error of every addition
+   is kept in compensation and added back (Kahan summation) */
+struct accumulator {
+  acc_t sum;
+  acc_t compensation;
+};
+
+static void accumulate(struct accumulator *a, acc_t x) {
+#ifdef FLOATING
+  acc_t y = x - a->compensation;
+  acc_t t = a->sum + y;
+  a->compensation = (t - a->sum) - y;
+  a->sum = t;
+#else
+  a->sum += x;
+#endif
+}
+
+//Position of the first element in row[from..to) equal to value
+static int firstIndexOf(const elem_t *row, int from, int to, elem_t value) {
+  while (from < to - 1 && row[from] != value) from++;
+  return from;
+}
+
+//Reduce one row for any element type. The row is cut into tiles of TILE elements. Each tile
+//is summed into LANES independent partial sums, mins and maxes without branches, which the
+//compiler turns into vector code. Positions are only searched for when a tile beats the
+//running min or max, which is rare after the first tiles. On x86 the compiler also builds
+//AVX2 and AVX-512 versions of it and the loader picks the best one for the cpu
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target_clones("avx512f", "avx2", "default")))
+#endif
+static void reduceRowGeneric(const elem_t *row, int n, struct rowresult *r) {
+  struct accumulator sum = { 0, 0 };
+  r->min = r->max = row[0];
+  r->minPos = r->maxPos = 0;
+
+  for (int t = 0; t < n; t += TILE) {
+    int end = (n - t < TILE) ? n : t + TILE, j = t, l;
+    lane_t laneSum[LANES];
+    acc_t tileSum = 0;
+    elem_t laneMin[LANES], laneMax[LANES], tileMin = row[t], tileMax = row[t];
+
+    for (l = 0; l < LANES; l++) {
+      laneSum[l] = 0;
+      laneMin[l] = laneMax[l] = row[t];
+    }
+    for (; j + LANES <= end; j += LANES) {
+      for (l = 0; l < LANES; l++) {
+        elem_t v = row[j + l];
+        laneSum[l] += v;
+        laneMin[l] = (v < laneMin[l]) ? v : laneMin[l];
+        laneMax[l] = (v > laneMax[l]) ? v : laneMax[l];
+      }
+    }
+    for (; j < end; j++) {
+      tileSum += row[j];
+      tileMin = (row[j] < tileMin) ? row[j] : tileMin;
+      tileMax = (row[j] > tileMax) ? row[j] : tileMax;
+    }
+    for (l = 0; l < LANES; l++) {
+      tileSum += laneSum[l];
+      tileMin = (laneMin[l] < tileMin) ? laneMin[l] : tileMin;
+      tileMax = (laneMax[l] > tileMax) ? laneMax[l] : tileMax;
+    }
+
+    accumulate(&sum, tileSum);
+    if (tileMin < r->min) {
+      r->min = tileMin;
+      r->minPos = firstIndexOf(row, t, end, tileMin);
+    }
+    if (tileMax > r->max) {
+      r->max = tileMax;
+      r->maxPos = firstIndexOf(row, t, end, tileMax);
+    }
+  }
+  r->sum = sum.sum;
+}
+
+#if defined(ELEMENT_INT32) && (defined(__x86_64__) || defined(__i386__))
+//Combine the vector lanes and the scalar tail. On equal values the lowest position wins,
+//which gives the same answer as a left to right scan
+static void reduceLanes(const int *row, int n, int j, int lanes, const int64_t *sum,
+                        const int *min, const int *minPos, const int *max, const int *maxPos,
+                        struct rowresult *r) {
+  r->sum = 0;
+  r->min = min[0]; r->minPos = minPos[0];
+  r->max = max[0]; r->maxPos = maxPos[0];
+  for (int l = 0; l < lanes; l++) {
+    r->sum += sum[l];
+    if (min[l] < r->min || (min[l] == r->min && minPos[l] < r->minPos)) {
+      r->min = min[l]; r->minPos = minPos[l];
+    }
+    if (max[l] > r->max || (max[l] == r->max && maxPos[l] < r->maxPos)) {
+      r->max = max[l]; r->maxPos = maxPos[l];
+    }
+  }
+  for (; j < n; j++) {
+    r->sum += row[j];
+    if (row[j] < r->min) { r->min = row[j]; r->minPos = j; }
+    if (row[j] > r->max) { r->max = row[j]; r->maxPos = j; }
+  }
+}
+
+//Every lane keeps its own min and max and the position where it was found.
+//The sums are widened to 64 bits so that long rows of large values cannot overflow
+__attribute__((target("sse4.1")))
+static void reduceRowSSE(const int *row, int n, struct rowresult *r) {
+  int min[4], minPos[4], max[4], maxPos[4], j = 0;
+  int64_t sum[4];
+  if (n < 4) { reduceRowGeneric(row, n, r); return; }
+
+  __m128i pos = _mm_setr_epi32(0, 1, 2, 3), step = _mm_set1_epi32(4);
+  __m128i vmin = _mm_loadu_si128((const __m128i *) row), vmax = vmin;
+  __m128i vsumLo = _mm_setzero_si128(), vsumHi = _mm_setzero_si128();
+  __m128i vminPos = pos, vmaxPos = pos;
+  for (; j + 4 <= n; j += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (row + j));
+    vsumLo = _mm_add_epi64(vsumLo, _mm_cvtepi32_epi64(v));
+    vsumHi = _mm_add_epi64(vsumHi, _mm_cvtepi32_epi64(_mm_srli_si128(v, 8)));
+    vminPos = _mm_blendv_epi8(vminPos, pos, _mm_cmplt_epi32(v, vmin));
+    vmaxPos = _mm_blendv_epi8(vmaxPos, pos, _mm_cmpgt_epi32(v, vmax));
+    vmin = _mm_min_epi32(vmin, v);
+    vmax = _mm_max_epi32(vmax, v);
+    pos = _mm_add_epi32(pos, step);
+  }
+  _mm_storeu_si128((__m128i *) sum, vsumLo);
+  _mm_storeu_si128((__m128i *) (sum + 2), vsumHi);
+  _mm_storeu_si128((__m128i *) min, vmin);
+  _mm_storeu_si128((__m128i *) minPos, vminPos);
+  _mm_storeu_si128((__m128i *) max, vmax);
+  _mm_storeu_si128((__m128i *) maxPos, vmaxPos);
+  reduceLanes(row, n, j, 4, sum, min, minPos, max, maxPos, r);
+}
+
+__attribute__((target("avx2")))
+static void reduceRowAVX2(const int *row, int n, struct rowresult *r) {
+  int min[8], minPos[8], max[8], maxPos[8], j = 0;
+  int64_t sum[8];
+  if (n < 8) { reduceRowGeneric(row, n, r); return; }
+
+  __m256i pos = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), step = _mm256_set1_epi32(8);
+  __m256i vmin = _mm256_loadu_si256((const __m256i *) row), vmax = vmin;
+  __m256i vsumLo = _mm256_setzero_si256(), vsumHi = _mm256_setzero_si256();
+  __m256i vminPos = pos, vmaxPos = pos;
+  for (; j + 8 <= n; j += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (row + j));
+    vsumLo = _mm256_add_epi64(vsumLo, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(v)));
+    vsumHi = _mm256_add_epi64(vsumHi, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1)));
+    vminPos = _mm256_blendv_epi8(vminPos, pos, _mm256_cmpgt_epi32(vmin, v));
+    vmaxPos = _mm256_blendv_epi8(vmaxPos, pos, _mm256_cmpgt_epi32(v, vmax));
+    vmin = _mm256_min_epi32(vmin, v);
+    vmax = _mm256_max_epi32(vmax, v);
+    pos = _mm256_add_epi32(pos, step);
+  }
+  _mm256_storeu_si256((__m256i *) sum, vsumLo);
+  _mm256_storeu_si256((__m256i *) (sum + 4), vsumHi);
+  _mm256_storeu_si256((__m256i *) min, vmin);
+  _mm256_storeu_si256((__m256i *) minPos, vminPos);
+  _mm256_storeu_si256((__m256i *) max, vmax);
+  _mm256_storeu_si256((__m256i *) maxPos, vmaxPos);
+  reduceLanes(row, n, j, 8, sum, min, minPos, max, maxPos, r);
+}
+
+__attribute__((target("avx512f")))
+static void reduceRowAVX512(const int *row, int n, struct rowresult *r) {
+  int min[16], minPos[16], max[16], maxPos[16], j = 0;
+  int64_t sum[16];
+  if (n < 16) { reduceRowGeneric(row, n, r); return; }
+
+  __m512i pos = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  __m512i step = _mm512_set1_epi32(16);
+  __m512i vmin = _mm512_loadu_si512(row), vmax = vmin;
+  __m512i vsumLo = _mm512_setzero_si512(), vsumHi = _mm512_setzero_si512();
+  __m512i vminPos = pos, vmaxPos = pos;
+  for (; j + 16 <= n; j += 16) {
+    __m512i v = _mm512_loadu_si512(row + j);
+    vsumLo = _mm512_add_epi64(vsumLo, _mm512_cvtepi32_epi64(_mm512_castsi512_si256(v)));
+    vsumHi = _mm512_add_epi64(vsumHi, _mm512_cvtepi32_epi64(_mm512_extracti64x4_epi64(v, 1)));
+    vminPos = _mm512_mask_blend_epi32(_mm512_cmplt_epi32_mask(v, vmin), vminPos, pos);
+    vmaxPos = _mm512_mask_blend_epi32(_mm512_cmpgt_epi32_mask(v, vmax), vmaxPos, pos);
+    vmin = _mm512_min_epi32(vmin, v);
+    vmax = _mm512_max_epi32(vmax, v);
+    pos = _mm512_add_epi32(pos, step);
+  }
+  _mm512_storeu_si512(sum, vsumLo);
+  _mm512_storeu_si512(sum + 8, vsumHi);
+  _mm512_storeu_si512(min, vmin);
+  _mm512_storeu_si512(minPos, vminPos);
+  _mm512_storeu_si512(max, vmax);
+  _mm512_storeu_si512(maxPos, vmaxPos);
+  reduceLanes(row, n, j, 16, sum, min, minPos, max, maxPos, r);
+}
+#endif
+
+/* the row kernel, picked once at startup for the element type and the cpu we run on */
+void (*reduceRow)(const elem_t *row, int n, struct rowresult *r) = reduceRowGeneric;
+const char *kernelName = "generic";
+
+static void initReduceRow(void) {
+#if defined(ELEMENT_INT32) && (defined(__x86_64__) || defined(__i386__))
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    reduceRow = reduceRowAVX512; kernelName = "avx512";
+  } else if (__builtin_cpu_supports("avx2")) {
+    reduceRow = reduceRowAVX2; kernelName = "avx2";
+  } else if (__builtin_cpu_supports("sse4.1")) {
+    reduceRow = reduceRowSSE; kernelName = "sse4.1";
+  }
+#endif
+}
+
+#endif
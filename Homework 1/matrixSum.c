@@ -1,12 +1,60 @@
 /* matrix summation using pthreads
 
-   features: uses a barrier; the Worker[0] computes
-             the total sum from partial sums computed by Workers
-             and prints the total sum to the standard output
+   features: uses a barrier; the partial sums computed by Workers are
+             combined in a tree inside the final barrier and the Worker[0]
+             prints the total sum to the standard output
 
    usage under Linux:
-     gcc matrixSum.c -lpthread
-     a.out size numWorkers
+     gcc -O3 matrixSum.c -lpthread
+     a.out size numWorkers [options]
+
+   options can be given in any order:
+     barrier            mutex (default), sense, tree or dissemination
+     schedule[:chunk]   static (default) gives every worker one strip of rows,
+                        dynamic lets workers claim chunk rows at a time from a
+                        shared counter, steal starts every worker on its own strip
+                        and lets it steal half of the largest remaining strip when
+                        it runs out. chunk defaults to 16 rows.
+     runs:N             repeat the summation N times and print the min, median,
+                        99th percentile and max time. Run it next to a background
+                        load to compare the tail latency of the schedules.
+
+   size is either n for an n x n matrix or rowsxcolumns, e.g. 5000x20000.
+   The matrix is allocated with mmap at the requested size and backed by
+   transparent huge pages; compile with -DEXPLICIT_HUGEPAGES to use the
+   hugetlbfs pool (vm.nr_hugepages) when it has enough pages.
+
+   Each row is summed by an SSE4.1, AVX2 or AVX-512 kernel picked at startup
+   (scalar fallback on other cpus) that finds the min and max in the same pass.
+
+   The element type is int by default; compile with -DELEMENT_INT8, -DELEMENT_INT16,
+   -DELEMENT_INT64, -DELEMENT_FLOAT or -DELEMENT_DOUBLE for other types. These use
+   a generic kernel that the compiler vectorizes at -O3. Integer sums are 64 bit,
+   floating point sums use Kahan summation.
+
+   The matrix is filled in parallel from a counter based random number generator,
+   every worker first touches the strip it sums so that the pages end up on its
+   numa node. The timing does not include the initialization.
+
+   The spinning barriers spin for a while and then sleep on a futex.
+
+   reduce a matrix stored in a binary file of ints in row major order:
+     a.out file path size numWorkers [options] [mmap|read]
+   mmap (default) maps the file and asks the kernel to read ahead the next
+   chunk while the current one is reduced, read streams the rows through two
+   buffers with pread, a reader thread fills one while the worker reduces the
+   other. The file is evicted from the page cache before every run and the
+   GB/s of the reduction is reported next to the GB/s of a plain sequential
+   read of the file.
+   write the generated matrix to a file:
+     a.out save path size
+
+   persistent worker pool benchmark (reductions per second of a small matrix,
+   compared with creating the threads for every reduction):
+     a.out poolbench size numWorkers [reductions]
+
+   barrier microbenchmark (latency per barrier episode for 1..maxWorkers threads):
+     a.out barrierbench maxWorkers [barrier] [episodes]
 
 */
 //ifndef = if the following is NOT defined
@@ -14,23 +62,111 @@
 #define _REENTRANT
 #define DEBUG
 #endif
+#define _GNU_SOURCE  /* for pthread_setaffinity_np */
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <float.h>
+#include <stdatomic.h>
 #include <time.h>
+#include <unistd.h>
 #include <sys/time.h>
-#define MAXSIZE 10000  /* maximum matrix size */
-#define MAXWORKERS 10   /* maximum number of workers */
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+//The element type, the matrix and the row kernels are shared with the OpenMP version
+#include "matrixReduce.h"
+
+#define MAXSIZE 10000  /* default matrix size */
+#define MAXWORKERS 128  /* maximum number of workers */
+#define CACHELINE 64    /* size of a cache line in bytes */
+#define SPINLIMIT 2000  /* spins before a waiting worker goes to sleep on a futex */
+#define TREEFANIN 4     /* number of children per node in the combining tree barrier */
+#define MAXROUNDS 8     /* rounds of the dissemination barrier, enough for 2^8 workers */
+#define CHUNKBYTES (8*1024*1024)    /* bytes read or mapped ahead at a time from a matrix file */
 
 pthread_mutex_t barrier;  /* mutex lock for the barrier */
 pthread_cond_t go;        /* condition variable for leaving */
 int numWorkers;           /* number of workers */
 int numArrived = 0;       /* number who have arrived */
 
+enum barriertype { MUTEX, SENSE, TREE, DISSEMINATION };
+const char *barrierNames[] = { "mutex", "sense", "tree", "dissemination" };
+enum barriertype barrierType = MUTEX;
+
+/* a word that workers spin on and, after SPINLIMIT tries, sleep on */
+struct waitword {
+  _Alignas(CACHELINE) atomic_int value;
+  atomic_int sleepers;
+};
+
+/* per worker barrier state, one cache line each */
+struct barrierlocal {
+  _Alignas(CACHELINE) int sense;
+  int parity;
+  int episode;   /* number of combining barriers passed */
+};
+
+/* node in the combining tree, the last worker to arrive moves on to the parent */
+struct treenode {
+  _Alignas(CACHELINE) atomic_int count;
+  int expected;
+  struct treenode *parent;
+};
+
+struct barrierlocal barrierLocal[MAXWORKERS];
+struct waitword releaseFlag;  /* flipped by the last worker to arrive (sense and tree) */
+atomic_int senseCount;        /* number who have arrived (sense) */
+struct treenode treeNodes[2*MAXWORKERS];
+struct treenode *treeLeaf[MAXWORKERS];
+struct waitword dissFlags[MAXWORKERS][2][MAXROUNDS];
+struct waitword arrivedFlags[MAXWORKERS];  /* episode the subtree of a worker is combined for (combining barrier) */
+struct waitword combinedFlag;              /* episode the combined result is ready for */
+int dissRounds;
+
+void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+//Wait until the word no longer holds "old". Spin first so short waits never enter the kernel
+void waitWhile(struct waitword *w, int old) {
+  for (int spins = 0; spins < SPINLIMIT; spins++) {
+    if (atomic_load_explicit(&w->value, memory_order_acquire) != old) return;
+    cpuRelax();
+  }
+  //Register as a sleeper before the last check so that setAndWake cannot miss us
+  atomic_fetch_add(&w->sleepers, 1);
+  while (atomic_load(&w->value) == old)
+    syscall(SYS_futex, &w->value, FUTEX_WAIT_PRIVATE, old, NULL, NULL, 0);
+  atomic_fetch_sub(&w->sleepers, 1);
+}
+
+//Store a new value and only make the futex system call if somebody is asleep
+void setAndWake(struct waitword *w, int value) {
+  atomic_store(&w->value, value);
+  if (atomic_load(&w->sleepers) > 0)
+    syscall(SYS_futex, &w->value, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+//Same as setAndWake, but adds to the value
+void addAndWake(struct waitword *w, int delta) {
+  atomic_fetch_add(&w->value, delta);
+  if (atomic_load(&w->sleepers) > 0)
+    syscall(SYS_futex, &w->value, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
 /* a reusable counter barrier */
 //Waits for all workers to arrive. If they have, wake all sleeping threads, else put threads to sleep
-void Barrier() {
+void mutexBarrier() {
   pthread_mutex_lock(&barrier);
   numArrived++;
   if (numArrived == numWorkers) {
@@ -41,6 +177,116 @@ void Barrier() {
   pthread_mutex_unlock(&barrier);
 }
 
+/* sense reversing barrier: one atomic counter, everybody spins on the release flag */
+void senseBarrier(long myid) {
+  int sense = barrierLocal[myid].sense = !barrierLocal[myid].sense;
+  if (atomic_fetch_add(&senseCount, 1) == numWorkers - 1) {
+    atomic_store_explicit(&senseCount, 0, memory_order_relaxed);
+    setAndWake(&releaseFlag, sense);
+  } else
+    waitWhile(&releaseFlag, !sense);
+}
+
+/* combining tree barrier: at most TREEFANIN workers share a counter */
+void treeBarrier(long myid) {
+  int sense = barrierLocal[myid].sense = !barrierLocal[myid].sense;
+  struct treenode *node = treeLeaf[myid];
+
+  //Climb the tree as long as we are the last to arrive at the node
+  while (atomic_fetch_add(&node->count, 1) == node->expected - 1) {
+    atomic_store_explicit(&node->count, 0, memory_order_relaxed);
+    if (node->parent == NULL) {
+      setAndWake(&releaseFlag, sense);
+      return;
+    }
+    node = node->parent;
+  }
+  waitWhile(&releaseFlag, !sense);
+}
+
+/* dissemination barrier: in round k signal worker myid+2^k and wait for worker myid-2^k */
+void disseminationBarrier(long myid) {
+  int parity = barrierLocal[myid].parity;
+  int sense = barrierLocal[myid].sense;
+  int k, distance;
+
+  for (k = 0, distance = 1; k < dissRounds; k++, distance *= 2) {
+    setAndWake(&dissFlags[(myid + distance) % numWorkers][parity][k], sense);
+    waitWhile(&dissFlags[myid][parity][k], !sense);
+  }
+  //Two sets of flags are used alternately, so the sense only has to flip every second episode
+  if (parity == 1) barrierLocal[myid].sense = !sense;
+  barrierLocal[myid].parity = 1 - parity;
+}
+
+void Barrier(long myid) {
+  switch (barrierType) {
+    case SENSE: senseBarrier(myid); break;
+    case TREE: treeBarrier(myid); break;
+    case DISSEMINATION: disseminationBarrier(myid); break;
+    default: mutexBarrier(); break;
+  }
+}
+
+//Reset the state of all barriers for numWorkers workers
+void initBarrier() {
+  int i, k, children, nodes, first, previous;
+
+  numArrived = 0;
+  atomic_init(&senseCount, 0);
+  atomic_init(&releaseFlag.value, 0);
+  atomic_init(&releaseFlag.sleepers, 0);
+  memset(dissFlags, 0, sizeof(dissFlags));
+  for (i = 0; i < numWorkers; i++) {
+    //The dissemination barrier starts with sense true, the others flip the sense before using it
+    barrierLocal[i].sense = (barrierType == DISSEMINATION);
+    barrierLocal[i].parity = 0;
+    barrierLocal[i].episode = 0;
+    atomic_init(&arrivedFlags[i].value, 0);
+  }
+  atomic_init(&combinedFlag.value, 0);
+
+  for (dissRounds = 0; (1 << dissRounds) < numWorkers; dissRounds++);
+
+  //Build the combining tree level by level, the workers are the children of the bottom level
+  children = numWorkers;
+  first = 0;
+  previous = -1;
+  do {
+    nodes = (children + TREEFANIN - 1)/TREEFANIN;
+    for (k = 0; k < nodes; k++) {
+      atomic_init(&treeNodes[first + k].count, 0);
+      treeNodes[first + k].expected = (children - k*TREEFANIN < TREEFANIN) ? children - k*TREEFANIN : TREEFANIN;
+      treeNodes[first + k].parent = NULL;
+    }
+    for (i = 0; i < children; i++) {
+      if (previous < 0)
+        treeLeaf[i] = &treeNodes[first + i/TREEFANIN];
+      else
+        treeNodes[previous + i].parent = &treeNodes[first + i/TREEFANIN];
+    }
+    previous = first;
+    first += nodes;
+    children = nodes;
+  } while (nodes > 1);
+}
+
+//Index of the first len characters of name in names, -1 if it is not there
+int lookup(const char *names[], int count, const char *name, size_t len) {
+  for (int i = 0; i < count; i++) {
+    if (strlen(names[i]) == len && strncmp(name, names[i], len) == 0) return i;
+  }
+  return -1;
+}
+
+//Look up a barrier by name, exit if there is no such barrier
+enum barriertype parseBarrier(const char *name) {
+  int i = lookup(barrierNames, sizeof(barrierNames)/sizeof(barrierNames[0]), name, strlen(name));
+  if (i >= 0) return i;
+  printf("ERROR: unknown barrier %s, use mutex, sense, tree or dissemination\n", name);
+  exit(1);
+}
+
 /* timer */
 double read_timer() {
     static bool initialized = false;
@@ -56,27 +302,415 @@ double read_timer() {
 }
 
 double start_time, end_time; /* start and end times */
-int size, stripSize;  /* assume size is multiple of numWorkers */
-int sums[MAXWORKERS]; /* partial sums */
-int matrix[MAXSIZE][MAXSIZE]; /* matrix */
-
-struct position{
-  int value;
-  int xPos;
-  int yPos;
-};
+int stripSize;  /* the last worker also takes the rows left over */
 
-struct position mins[MAXWORKERS];
-struct position maxs[MAXWORKERS];
+//Fill rows first..last with random values between 0 and 99
+void fillRows(int first, int last) {
+  for (int i = first; i <= last; i++) {
+    elem_t *row = ROW(i);
+    for (int j = 0; j < cols; j++) {
+      row[j] = randomBits((uint64_t) i*cols + j) % 99;
+    }
+  }
+}
+
+//Print the matrix if DEBUG is defined
+void printMatrix() {
+#ifdef DEBUG
+  for (int i = 0; i < rows; i++) {
+    printf("[ ");
+    for (int j = 0; j < cols; j++) {
+      printf(" " PRINT_FMT, (print_t) ROW(i)[j]);
+    }
+    printf(" ]\n");
+  }
+#endif
+}
+
+//Keep the worker on one cpu so that it stays next to the memory it touched first
+void pinWorker(long myid) {
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(myid % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+/* where the matrix comes from */
+enum inputmode { GENERATE, MMAPFILE, READFILE };
+enum inputmode inputMode = GENERATE;
+int inputFd;     /* matrix file */
+double rawTime;  /* seconds to read the matrix file without reducing it */
+
+/* how rows are handed out to the workers */
+enum scheduletype { STATIC, DYNAMIC, STEAL };
+const char *scheduleNames[] = { "static", "dynamic", "steal" };
+enum scheduletype scheduleType = STATIC;
+int chunkSize = 16;   /* rows claimed at a time by the dynamic and steal schedules */
+int numRuns = 1;      /* number of times the summation is repeated */
+double *runTimes;     /* execution time of every run */
+
+atomic_int nextRow;   /* next row to claim in the dynamic schedule */
+
+/* rows [lo, hi) a worker has not claimed yet, in one word so that the owner and thieves can CAS them */
+struct workrange {
+  _Alignas(CACHELINE) _Atomic uint64_t rows;
+};
+struct workrange ranges[MAXWORKERS];
+#define PACK(lo, hi) (((uint64_t) (hi) << 32) | (uint32_t) (lo))
+#define LO(r) ((int) (uint32_t) (r))
+#define HI(r) ((int) ((r) >> 32))
 
 void *Worker(void *);
+void barrierBenchmark(int maxWorkers, int episodes);
+void poolBenchmark(int reductions);
+
+/* first and last row of the strip of a worker */
+int stripFirst(long id) {
+  return id*stripSize;
+}
+
+int stripLast(long id) {
+  return (id == numWorkers - 1) ? (rows - 1) : (id*stripSize + stripSize - 1);
+}
+
+//Give every worker its strip back before a run
+void resetSchedule() {
+  atomic_store(&nextRow, 0);
+  for (int w = 0; w < numWorkers; w++)
+    atomic_store(&ranges[w].rows, PACK(stripFirst(w), stripLast(w) + 1));
+}
+
+//Take up to chunkSize rows from the front of the range of a worker
+int takeFront(long w, int *first) {
+  uint64_t r = atomic_load(&ranges[w].rows);
+  while (LO(r) < HI(r)) {
+    int n = (HI(r) - LO(r) < chunkSize) ? HI(r) - LO(r) : chunkSize;
+    if (atomic_compare_exchange_weak(&ranges[w].rows, &r, PACK(LO(r) + n, HI(r)))) {
+      *first = LO(r);
+      return n;
+    }
+  }
+  return 0;
+}
+
+//Steal the back half of the largest range of another worker and make it our own.
+//Returns 0 when every row has been claimed
+int steal(long myid) {
+  while (1) {
+    int victim = -1, most = 0;
+    for (int w = 0; w < numWorkers; w++) {
+      uint64_t r = atomic_load_explicit(&ranges[w].rows, memory_order_relaxed);
+      if (w != myid && HI(r) - LO(r) > most) {
+        most = HI(r) - LO(r);
+        victim = w;
+      }
+    }
+    if (victim < 0) return 0;
+
+    uint64_t r = atomic_load(&ranges[victim].rows);
+    int half = (HI(r) - LO(r) + 1)/2;
+    if (half > 0 && atomic_compare_exchange_strong(&ranges[victim].rows, &r, PACK(LO(r), HI(r) - half))) {
+      atomic_store(&ranges[myid].rows, PACK(HI(r) - half, HI(r)));
+      return 1;
+    }
+  }
+}
+
+//Claim the next rows to sum. Returns how many rows were claimed, 0 when the matrix is done
+int claimRows(long myid, int *first) {
+  int n;
+  uint64_t r;
+
+  switch (scheduleType) {
+    case DYNAMIC:
+      *first = atomic_fetch_add(&nextRow, chunkSize);
+      return (*first >= rows) ? 0 : (rows - *first < chunkSize) ? rows - *first : chunkSize;
+    case STEAL:
+      while ((n = takeFront(myid, first)) == 0)
+        if (!steal(myid)) return 0;
+      return n;
+    default:
+      //The whole strip at once
+      r = atomic_exchange(&ranges[myid].rows, PACK(0, 0));
+      *first = LO(r);
+      return HI(r) - LO(r);
+  }
+}
+
+//The arguments after numWorkers come in any order: a barrier, a schedule with an optional
+//chunk size, runs:N, and mmap or read in the file mode
+void parseOption(const char *arg) {
+  const char *value = strchr(arg, ':');
+  size_t len = value ? (size_t) (value - arg) : strlen(arg);
+  int i;
+
+  if (!value && (i = lookup(barrierNames, sizeof(barrierNames)/sizeof(barrierNames[0]), arg, len)) >= 0)
+    barrierType = i;
+  else if ((i = lookup(scheduleNames, sizeof(scheduleNames)/sizeof(scheduleNames[0]), arg, len)) >= 0) {
+    scheduleType = i;
+    if (value) chunkSize = atoi(value + 1);
+  }
+  else if (value && strncmp(arg, "runs", len) == 0 && len == 4)
+    numRuns = atoi(value + 1);
+  else if (inputMode != GENERATE && strcmp(arg, "read") == 0)
+    inputMode = READFILE;
+  else if (inputMode != GENERATE && strcmp(arg, "mmap") == 0)
+    inputMode = MMAPFILE;
+  else {
+    printf("ERROR: unknown option %s\n", arg);
+    exit(1);
+  }
+  if (chunkSize < 1 || numRuns < 1) {
+    printf("ERROR: chunk size and runs must be at least 1\n");
+    exit(1);
+  }
+}
+
+int compareDoubles(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+//Should position a replace b as the minimum. yPos is -1 while there is no position yet.
+//Rows may be reduced in any order, so on equal values the row closest to the top wins
+int replacesMin(struct position a, struct position b) {
+  return a.yPos >= 0 && (b.yPos < 0 || a.value < b.value || (a.value == b.value && a.yPos < b.yPos));
+}
+
+int replacesMax(struct position a, struct position b) {
+  return a.yPos >= 0 && (b.yPos < 0 || a.value > b.value || (a.value == b.value && a.yPos < b.yPos));
+}
+
+/* partial result of one worker, one cache line each so that workers never write to the same line */
+struct partial {
+  _Alignas(CACHELINE) struct accumulator total;
+  struct position min, max;
+};
+
+struct partial partials[MAXWORKERS];
+struct partial combined;  /* result of the last combining barrier */
+
+//Add partial b to a
+void mergePartial(struct partial *a, const struct partial *b) {
+  accumulate(&a->total, b->total.sum - b->total.compensation);
+  if (replacesMin(b->min, a->min)) a->min = b->min;
+  if (replacesMax(b->max, a->max)) a->max = b->max;
+}
+
+/* combining barrier: the partials are added up in a binary tree while the workers arrive.
+   In round k worker i (a multiple of 2^(k+1)) waits for worker i+2^k and merges its subtree,
+   the other workers pass their subtree up and wait. Worker(0) ends up with the total and
+   publishes it in combined, which every worker can read when it leaves the barrier */
+void combineBarrier(long myid) {
+  int episode = ++barrierLocal[myid].episode;
+  int distance, seen;
+
+  for (distance = 1; distance < numWorkers; distance *= 2) {
+    if (myid % (2*distance) != 0) {
+      setAndWake(&arrivedFlags[myid], episode);
+      break;
+    }
+    if (myid + distance < numWorkers) {
+      while ((seen = atomic_load(&arrivedFlags[myid + distance].value)) != episode)
+        waitWhile(&arrivedFlags[myid + distance], seen);
+      mergePartial(&partials[myid], &partials[myid + distance]);
+    }
+  }
+
+  if (myid == 0) {
+    combined = partials[0];
+    setAndWake(&combinedFlag, episode);
+  }
+  else {
+    while ((seen = atomic_load(&combinedFlag.value)) != episode)
+      waitWhile(&combinedFlag, seen);
+  }
+}
+
+//Reduce n rows of width elements, the first one is row number firstRow and is found at data
+void reduceRows(const elem_t *data, size_t rowStride, int firstRow, int n, int width,
+                struct accumulator *total, struct position *minPosition, struct position *maxPosition) {
+  for (int i = 0; i < n; i++) {
+    struct rowresult row;
+    reduceRow(data + i*rowStride, width, &row);
+    accumulate(total, row.sum);
+    struct position rowMin = { row.min, row.minPos, firstRow + i };
+    struct position rowMax = { row.max, row.maxPos, firstRow + i };
+    if (replacesMin(rowMin, *minPosition)) *minPosition = rowMin;
+    if (replacesMax(rowMax, *maxPosition)) *maxPosition = rowMax;
+  }
+}
+
+//Number of whole rows in one chunk of a matrix file, at least one
+int chunkRows() {
+  int n = CHUNKBYTES / (cols*sizeof(elem_t));
+  return (n > 0) ? n : 1;
+}
+
+//Write the matrix to a file so that it can be reduced with the file mode later
+void saveMatrix(const char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    printf("ERROR: could not create %s\n", path);
+    exit(1);
+  }
+  for (int i = 0; i < rows; i++) {
+    if (write(fd, ROW(i), cols*sizeof(elem_t)) != (ssize_t) (cols*sizeof(elem_t))) {
+      printf("ERROR: could not write %s\n", path);
+      exit(1);
+    }
+  }
+  close(fd);
+}
+
+//Open the matrix file and check that it holds rows x cols ints
+void openMatrixFile(const char *path) {
+  struct stat st;
+  inputFd = open(path, O_RDONLY);
+  if (inputFd < 0 || fstat(inputFd, &st) != 0) {
+    printf("ERROR: could not open %s\n", path);
+    exit(1);
+  }
+  if (st.st_size < (off_t) ((size_t) rows*cols*sizeof(elem_t))) {
+    printf("ERROR: %s holds %lld bytes, a %dx%d matrix needs %zu\n",
+           path, (long long) st.st_size, rows, cols, (size_t) rows*cols*sizeof(elem_t));
+    exit(1);
+  }
+}
+
+//Drop the file from the page cache so that the next pass really reads the disk. Pages
+//mapped by the mmap mode are unmapped from this process first, the cache keeps them otherwise
+void evictMatrixFile() {
+  if (inputMode == MMAPFILE)
+    madvise(matrix, (size_t) rows*cols*sizeof(elem_t), MADV_DONTNEED);
+  fdatasync(inputFd);
+  posix_fadvise(inputFd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+//Time a plain sequential read of the matrix file, this is the best we can hope for
+void measureRawRead() {
+  char *buffer = allocMatrix(CHUNKBYTES);
+  off_t offset = 0, bytes = (off_t) rows*cols*sizeof(elem_t);
+  ssize_t got;
+  double start;
+
+  evictMatrixFile();
+  posix_fadvise(inputFd, 0, bytes, POSIX_FADV_SEQUENTIAL);
+  start = read_timer();
+  while (offset < bytes && (got = pread(inputFd, buffer, CHUNKBYTES, offset)) > 0)
+    offset += got;
+  rawTime = read_timer() - start;
+  munmap(buffer, CHUNKBYTES);
+  evictMatrixFile();
+}
+
+//Read n rows of the matrix file from row first on into buffer, exits on an error
+void readRows(elem_t *buffer, int first, int n) {
+  size_t rowBytes = cols*sizeof(elem_t), done = 0;
+  while (done < n*rowBytes) {
+    ssize_t got = pread(inputFd, (char *) buffer + done, n*rowBytes - done, (off_t) first*rowBytes + done);
+    if (got <= 0) {
+      printf("ERROR: could not read the matrix file\n");
+      exit(1);
+    }
+    done += got;
+  }
+}
+
+/* a strip of the matrix file that a reader thread reads chunk by chunk into two buffers
+   while its worker reduces the chunk in the other buffer */
+struct stripReader {
+  elem_t *buffer[2];    /* allocated on first use, kept for the next strips */
+  bool full[2];         /* read and not yet reduced */
+  int first, last;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+};
+struct stripReader readers[MAXWORKERS];
+
+//Read the chunks of the strip into the buffers in turn, waiting for the worker to empty one
+void *readStrip(void *arg) {
+  struct stripReader *reader = arg;
+  int perChunk = chunkRows(), current = 0, i, n;
+
+  for (i = reader->first; i <= reader->last; i += n, current = 1 - current) {
+    n = (reader->last - i + 1 < perChunk) ? reader->last - i + 1 : perChunk;
+    pthread_mutex_lock(&reader->lock);
+    while (reader->full[current]) pthread_cond_wait(&reader->changed, &reader->lock);
+    pthread_mutex_unlock(&reader->lock);
+
+    readRows(reader->buffer[current], i, n);
+
+    pthread_mutex_lock(&reader->lock);
+    reader->full[current] = true;
+    pthread_cond_signal(&reader->changed);
+    pthread_mutex_unlock(&reader->lock);
+  }
+  return NULL;
+}
+
+//Stream rows first..last of the matrix file through two buffers. A strip of more than one
+//chunk gets a reader thread that reads the next chunk while this one is reduced
+void reduceStripFromFile(long myid, int first, int last, struct accumulator *total,
+                         struct position *minPosition, struct position *maxPosition) {
+  struct stripReader *reader = &readers[myid];
+  int perChunk = chunkRows(), current = 0, i, n;
+  pthread_t thread;
+
+  if (reader->buffer[0] == NULL) {
+    reader->buffer[0] = allocMatrix(perChunk*cols*sizeof(elem_t));
+    reader->buffer[1] = allocMatrix(perChunk*cols*sizeof(elem_t));
+    pthread_mutex_init(&reader->lock, NULL);
+    pthread_cond_init(&reader->changed, NULL);
+  }
+  //Nothing to overlap the read with
+  if (last - first < perChunk) {
+    readRows(reader->buffer[0], first, last - first + 1);
+    reduceRows(reader->buffer[0], cols, first, last - first + 1, cols, total, minPosition, maxPosition);
+    return;
+  }
+
+  reader->first = first;
+  reader->last = last;
+  reader->full[0] = reader->full[1] = false;
+  pthread_create(&thread, NULL, readStrip, reader);
+  for (i = first; i <= last; i += n, current = 1 - current) {
+    n = (last - i + 1 < perChunk) ? last - i + 1 : perChunk;
+    pthread_mutex_lock(&reader->lock);
+    while (!reader->full[current]) pthread_cond_wait(&reader->changed, &reader->lock);
+    pthread_mutex_unlock(&reader->lock);
+
+    reduceRows(reader->buffer[current], cols, i, n, cols, total, minPosition, maxPosition);
+
+    pthread_mutex_lock(&reader->lock);
+    reader->full[current] = false;
+    pthread_cond_signal(&reader->changed);
+    pthread_mutex_unlock(&reader->lock);
+  }
+  pthread_join(thread, NULL);
+}
+
+//Reduce rows first..last of the mapped matrix file, asking for the next chunk before reducing this one
+void reduceStripFromMapping(int first, int last, struct accumulator *total,
+                            struct position *minPosition, struct position *maxPosition) {
+  int perChunk = chunkRows(), i, n;
+  long page = sysconf(_SC_PAGESIZE);
+
+  for (i = first; i <= last; i += n) {
+    n = (last - i + 1 < perChunk) ? last - i + 1 : perChunk;
+    if (i + n <= last) {
+      uintptr_t next = (uintptr_t) ROW(i + n) & ~(uintptr_t) (page - 1);
+      madvise((void *) next, perChunk*stride*sizeof(elem_t), MADV_WILLNEED);
+    }
+    reduceRows(ROW(i), stride, i, n, cols, total, minPosition, maxPosition);
+  }
+}
 
 /* read command line, initialize, and create threads */
 //argc contains the number of arguments passed to the program
 //argv is an array that contains those arguments.
 int main(int argc, char *argv[]) {
 
-  int i, j;
   long l; /* use long in case of a 64-bit system */
   pthread_attr_t attr;
 
@@ -97,40 +731,85 @@ int main(int argc, char *argv[]) {
   pthread_mutex_init(&barrier, NULL);
   pthread_cond_init(&go, NULL);
 
+  /* run the barrier microbenchmark instead of the summation */
+  if (argc > 1 && strcmp(argv[1], "barrierbench") == 0) {
+    if (argc > 3) barrierType = parseBarrier(argv[3]);
+    barrierBenchmark((argc > 2)? atoi(argv[2]) : MAXWORKERS, (argc > 4)? atoi(argv[4]) : 100000);
+    return 0;
+  }
+
+  /* measure the worker pool on a small matrix instead of summing it once */
+  if (argc > 3 && strcmp(argv[1], "poolbench") == 0) {
+    int reductions = (argc > 4) ? atoi(argv[4]) : 10000;
+    parseSize(argv[2]);
+    numWorkers = atoi(argv[3]);
+    if (numWorkers < 1) numWorkers = 1;
+    if (numWorkers > MAXWORKERS) numWorkers = MAXWORKERS;
+    initReduceRow();
+    poolBenchmark(reductions);
+    return 0;
+  }
+
+  /* save the generated matrix to a file instead of summing it */
+  const char *savePath = NULL, *inputPath = NULL;
+  if (argc > 2 && strcmp(argv[1], "save") == 0) {
+    savePath = argv[2];
+    argc -= 2;
+    argv += 2;
+  }
+
+  /* read the matrix from a file, the remaining arguments are the usual ones */
+  if (argc > 2 && strcmp(argv[1], "file") == 0) {
+    inputPath = argv[2];
+    inputMode = MMAPFILE;
+    argc -= 2;
+    argv += 2;
+  }
+
   /* read command line args if any */
-  //Check if we have more than one command line argument. If we do, set size to argument 1, else set size to MAXSIZE
-  size = (argc > 1)? atoi(argv[1]) : MAXSIZE;
+  //Check if we have more than one command line argument. If we do, set the size to argument 1, else set size to MAXSIZE
+  rows = cols = MAXSIZE;
+  if (argc > 1) parseSize(argv[1]);
 
-  //Check if we have more than two command line arguments. If we do, set number of workers to argument 2, else set size to MAXWORKERS
-  numWorkers = (argc > 2)? atoi(argv[2]) : MAXWORKERS;
-  if (size > MAXSIZE) size = MAXSIZE;
+  //Check if we have more than two command line arguments. If we do, set number of workers to argument 2, else use one worker per cpu
+  numWorkers = (argc > 2)? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
   if (numWorkers > MAXWORKERS) numWorkers = MAXWORKERS;
+  for (int a = 3; a < argc; a++) parseOption(argv[a]);
+  runTimes = calloc(numRuns, sizeof(double));
+  initBarrier();
+  initReduceRow();
 
   //One strip is the part of the matrix that the worker should go through. For example, of the size of the matrix is 20 and we have 10 workers, each worker should go through one tenth of the array
-  stripSize = size/numWorkers;
+  stripSize = rows/numWorkers;
 
-  /* initialize the matrix */
-  //Fill the matrix with random values between 0 and 99
-  for (i = 0; i < size; i++) {
-	  for (j = 0; j < size; j++) {
-          matrix[i][j] = rand()%99;
-	  }
+  if (inputMode == GENERATE) {
+    /* allocate the matrix, every row is padded to a whole number of cache lines */
+    stride = (cols + CACHELINE/sizeof(elem_t) - 1) / (CACHELINE/sizeof(elem_t)) * (CACHELINE/sizeof(elem_t));
+    //The matrix is initialized by the workers, each one fills the strip it will sum later
+    //so that its pages are placed on the numa node of that worker
+    matrix = allocMatrix(rows*stride*sizeof(elem_t));
+  }
+  else {
+    //The file has no padding between rows
+    openMatrixFile(inputPath);
+    stride = cols;
+    if (inputMode == MMAPFILE) {
+      matrix = mmap(NULL, (size_t) rows*cols*sizeof(elem_t), PROT_READ, MAP_PRIVATE, inputFd, 0);
+      if (matrix == MAP_FAILED) {
+        printf("ERROR: could not map %s\n", inputPath);
+        exit(1);
+      }
+    }
+    measureRawRead();
   }
 
-  /* print the matrix */
-  //If DEBUG is defined, print the matrix
-#ifdef DEBUG
-  for (i = 0; i < size; i++) {
-	  printf("[ ");
-	  for (j = 0; j < size; j++) {
-	    printf(" %d", matrix[i][j]);
-	  }
-	  printf(" ]\n");
+  if (savePath != NULL) {
+    fillRows(0, rows - 1);
+    saveMatrix(savePath);
+    return 0;
   }
-#endif
 
   /* do the parallel work: create the workers */
-  start_time = read_timer();
   for (l = 0; l < numWorkers; l++)
 
     //Create a thread for the current worker that will start execution in the "Worker" routine with the argument (void *) l
@@ -138,82 +817,249 @@ int main(int argc, char *argv[]) {
   pthread_exit(NULL);
 }
 
-/* Each worker sums the values in one strip of the matrix.
+/* Each worker sums the rows it claims, one strip with the static schedule.
    After a barrier, worker(0) computes and prints the total */
 void *Worker(void *arg) {
   long myid = (long) arg;
-  int total, i, j, first, last;
+  struct accumulator total;
+  int first, n, run;
 
 //If debug is defined
 #ifdef DEBUG
-  printf("worker %d (pthread id %d) has started\n", myid, pthread_self());
+  printf("worker %d (pthread id %d) has started, %s kernel\n", myid, pthread_self(), kernelName);
 #endif
 
-  /* determine first and last rows of my strip */
-  //The first row for the perticular thread is the id multiplied by the size of a strip.
-  first = myid*stripSize;
-  last = (myid == numWorkers - 1) ? (size - 1) : (first + stripSize - 1);
-
-  /* sum values in my strip */
-  total = 0;
-  struct position minPosition;
-  struct position maxPosition;
-  minPosition.value = 99;
-  maxPosition.value = 0;
-  for (i = first; i <= last; i++){
-    for (j = 0; j < size; j++){
-      total += matrix[i][j];
-      if (matrix[i][j] < minPosition.value) {
-        minPosition.value = matrix[i][j];
-        minPosition.xPos = j;
-        minPosition.yPos = i;
-      }
-      if (matrix[i][j] > maxPosition.value) {
-        maxPosition.value = matrix[i][j];
-        maxPosition.xPos = j;
-        maxPosition.yPos = i;
-      }
-    }
-  }
-
-  sums[myid] = total;
-  mins[myid] = minPosition;
-  maxs[myid] = maxPosition;
-  Barrier();
+  /* initialize my strip, the timing starts when all strips are filled */
+  pinWorker(myid);
+  if (inputMode == GENERATE)
+    fillRows(stripFirst(myid), stripLast(myid));
+  Barrier(myid);
 
-  if (myid == 0) {
+  for (run = 0; run < numRuns; run++) {
+    //Worker(0) hands out the rows and starts the clock while the others wait in the barrier
+    if (myid == 0) {
+      if (run == 0 && inputMode == GENERATE) printMatrix();
+      //measureRawRead left the file evicted for the first run
+      if (run > 0 && inputMode != GENERATE) evictMatrixFile();
+      resetSchedule();
+      start_time = read_timer();
+    }
+    Barrier(myid);
 
-    total = 0;
-    for (i = 0; i < numWorkers; i++){
-      total += sums[i];
+    /* sum values in the rows I claim */
+    struct position minPosition = { ELEM_MAX, 0, -1 };
+    struct position maxPosition = { ELEM_MIN, 0, -1 };
+    total.sum = total.compensation = 0;
+    //Each row is reduced by the vectorized kernel, only the per row results are compared here
+    while ((n = claimRows(myid, &first)) > 0) {
+      if (inputMode == READFILE)
+        reduceStripFromFile(myid, first, first + n - 1, &total, &minPosition, &maxPosition);
+      else if (inputMode == MMAPFILE)
+        reduceStripFromMapping(first, first + n - 1, &total, &minPosition, &maxPosition);
+      else
+        reduceRows(ROW(first), stride, first, n, cols, &total, &minPosition, &maxPosition);
     }
 
-    int currentMin = 99;
-    int currentMax = 0;
-    int xPosMin;
-    int yPosMin;
-    int xPosMax;
-    int yPosMax;
+    //Workers that got no rows have yPos -1, mergePartial skips them
+    partials[myid].total = total;
+    partials[myid].min = minPosition;
+    partials[myid].max = maxPosition;
+    combineBarrier(myid);
 
-    for (int j = 0; j < numWorkers; j++) {
-      if(mins[j].value < currentMin){
-        currentMin = mins[j].value;
-        xPosMin = mins[j].xPos;
-        yPosMin = mins[j].yPos;
-      }
-      if(maxs[j].value > currentMax){
-        currentMax = maxs[j].value;
-        xPosMax = maxs[j].xPos;
-        yPosMax = maxs[j].yPos;
-      }
+    if (myid == 0) {
+      /* get end time */
+      end_time = read_timer();
+      runTimes[run] = end_time - start_time;
     }
+  }
 
-    /* get end time */
-    end_time = read_timer();
+  if (myid == 0) {
     /* print results */
-    printf("The total is %d\n", total);
-    printf("the minimum is %d at position x = %d, y = %d\n", currentMin, xPosMin, yPosMin);
-    printf("the maximum is %d at position x = %d, y = %d\n", currentMax, xPosMax, yPosMax);
+    printf("The total is " PRINT_FMT "\n", (print_t) combined.total.sum);
+    printf("the minimum is " PRINT_FMT " at position x = %d, y = %d\n", (print_t) combined.min.value, combined.min.xPos, combined.min.yPos);
+    printf("the maximum is " PRINT_FMT " at position x = %d, y = %d\n", (print_t) combined.max.value, combined.max.xPos, combined.max.yPos);
     printf("The execution time is %g sec\n", end_time - start_time);
+    if (inputMode != GENERATE) {
+      double gigabytes = (double) rows*cols*sizeof(elem_t) / 1.0e9;
+      printf("Reduced %g GB at %g GB/s, a sequential read of the file runs at %g GB/s\n",
+             gigabytes, gigabytes / (end_time - start_time), gigabytes / rawTime);
+    }
+    if (numRuns > 1) {
+      qsort(runTimes, numRuns, sizeof(double), compareDoubles);
+      printf("%s schedule, %d runs: min %g, median %g, 99th percentile %g, max %g sec\n",
+             scheduleNames[scheduleType], numRuns, runTimes[0], runTimes[numRuns/2],
+             runTimes[(99*numRuns + 99)/100 - 1], runTimes[numRuns - 1]);
+    }
   }
+  return NULL;
+}
+
+int benchEpisodes;
+
+/* Each worker passes the barrier benchEpisodes times.
+   Worker(0) times the episodes after a warm up barrier */
+void *BenchWorker(void *arg) {
+  long myid = (long) arg;
+  double start;
+
+  Barrier(myid);
+  start = read_timer();
+  for (int e = 0; e < benchEpisodes; e++)
+    Barrier(myid);
+  if (myid == 0)
+    end_time = read_timer() - start;
+  return NULL;
+}
+
+//Measure the latency of one barrier episode for 1 up to maxWorkers workers
+void barrierBenchmark(int maxWorkers, int episodes) {
+  pthread_t workerid[MAXWORKERS];
+  long l;
+
+  if (maxWorkers > MAXWORKERS) maxWorkers = MAXWORKERS;
+  benchEpisodes = episodes;
+  pthread_mutex_init(&barrier, NULL);
+  pthread_cond_init(&go, NULL);
+
+  printf("%s barrier, %d episodes\n", barrierNames[barrierType], episodes);
+  printf("workers   usec per episode\n");
+  for (numWorkers = 1; numWorkers <= maxWorkers; numWorkers++) {
+    initBarrier();
+    for (l = 0; l < numWorkers; l++)
+      pthread_create(&workerid[l], NULL, BenchWorker, (void *) l);
+    for (l = 0; l < numWorkers; l++)
+      pthread_join(workerid[l], NULL);
+    printf("%7d   %g\n", numWorkers, 1.0e6 * end_time / episodes);
+  }
+}
+
+/* result of a reduction */
+struct reduction {
+  acc_t total;
+  struct position min, max;
+};
+
+/* a persistent pool of workers. Between jobs they sleep on poolGeneration,
+   which is bumped for every new job, and the thread that submitted the job
+   works on it as worker 0 */
+struct pooljob {
+  const elem_t *data;     /* first element of the region */
+  size_t stride;          /* elements from one row of the region to the next */
+  int rows, cols;         /* size of the region */
+  atomic_int nextRow;     /* next row to claim */
+};
+
+struct pooljob poolJob;
+struct waitword poolGeneration;  /* number of jobs submitted */
+struct waitword poolDone;        /* number of helpers done with the current job */
+struct partial poolPartials[MAXWORKERS];
+pthread_t poolThreads[MAXWORKERS];
+int poolSize;
+bool poolStopping;
+
+//Claim chunks of rows of the current job until there are none left
+void poolWork(long myid) {
+  struct accumulator total = { 0, 0 };
+  struct position minPosition = { ELEM_MAX, 0, -1 };
+  struct position maxPosition = { ELEM_MIN, 0, -1 };
+  int first;
+
+  while ((first = atomic_fetch_add(&poolJob.nextRow, chunkSize)) < poolJob.rows) {
+    int n = (poolJob.rows - first < chunkSize) ? poolJob.rows - first : chunkSize;
+    reduceRows(poolJob.data + first*poolJob.stride, poolJob.stride, first, n, poolJob.cols,
+               &total, &minPosition, &maxPosition);
+  }
+  poolPartials[myid].total = total;
+  poolPartials[myid].min = minPosition;
+  poolPartials[myid].max = maxPosition;
+}
+
+void *PoolWorker(void *arg) {
+  long myid = (long) arg;
+  int seen = 0;
+
+  pinWorker(myid);
+  while (1) {
+    //Sleep until the next job is submitted
+    waitWhile(&poolGeneration, seen);
+    seen = atomic_load(&poolGeneration.value);
+    if (poolStopping) return NULL;
+    poolWork(myid);
+    addAndWake(&poolDone, 1);
+  }
+}
+
+//Start size-1 helpers, the caller of poolReduce is the last worker
+void poolStart(int size) {
+  poolSize = size;
+  poolStopping = false;
+  atomic_init(&poolGeneration.value, 0);
+  atomic_init(&poolGeneration.sleepers, 0);
+  for (long l = 1; l < poolSize; l++)
+    pthread_create(&poolThreads[l], NULL, PoolWorker, (void *) l);
+}
+
+void poolStop() {
+  poolStopping = true;
+  addAndWake(&poolGeneration, 1);
+  for (int l = 1; l < poolSize; l++)
+    pthread_join(poolThreads[l], NULL);
+}
+
+//Reduce a region of rows x cols elements starting at data and wait for the result
+void poolReduce(const elem_t *data, size_t stride, int rows, int cols, struct reduction *result) {
+  int done;
+
+  poolJob.data = data;
+  poolJob.stride = stride;
+  poolJob.rows = rows;
+  poolJob.cols = cols;
+  atomic_store(&poolJob.nextRow, 0);
+  atomic_store(&poolDone.value, 0);
+  addAndWake(&poolGeneration, 1);
+
+  poolWork(0);
+  while ((done = atomic_load(&poolDone.value)) < poolSize - 1)
+    waitWhile(&poolDone, done);
+
+  for (int w = 1; w < poolSize; w++)
+    mergePartial(&poolPartials[0], &poolPartials[w]);
+  result->total = poolPartials[0].total.sum;
+  result->min = poolPartials[0].min;
+  result->max = poolPartials[0].max;
+}
+
+//Reductions per second with the pool, and with new threads for every reduction
+void poolBenchmark(int reductions) {
+  struct reduction result;
+  double start, pooled, spawned;
+  int r, spawnRuns = (reductions < 1000) ? reductions : 1000;
+
+  stride = (cols + CACHELINE/sizeof(elem_t) - 1) / (CACHELINE/sizeof(elem_t)) * (CACHELINE/sizeof(elem_t));
+  matrix = allocMatrix(rows*stride*sizeof(elem_t));
+  fillRows(0, rows - 1);
+
+  //The data changes between reductions, like it does when the pool is used for real
+  poolStart(numWorkers);
+  start = read_timer();
+  for (r = 0; r < reductions; r++) {
+    ROW(r % rows)[r % cols] = r % 99;
+    poolReduce(matrix, stride, rows, cols, &result);
+  }
+  pooled = read_timer() - start;
+  poolStop();
+
+  start = read_timer();
+  for (r = 0; r < spawnRuns; r++) {
+    ROW(r % rows)[r % cols] = r % 99;
+    poolStart(numWorkers);
+    poolReduce(matrix, stride, rows, cols, &result);
+    poolStop();
+  }
+  spawned = read_timer() - start;
+
+  printf("%dx%d matrix, %d workers, %s kernel\n", rows, cols, numWorkers, kernelName);
+  printf("persistent pool:      %g reductions/sec\n", reductions / pooled);
+  printf("threads per reduction: %g reductions/sec\n", spawnRuns / spawned);
+  printf("The total of the last reduction is " PRINT_FMT "\n", (print_t) result.total);
 }
@@ -3,33 +3,110 @@
    features: Approximates pi by calculating the area of the upper-right quadrant
              of the unit circle and multiplying it by four.
 
+             The adaptive quadrature runs on a fixed pool of workers (one per cpu
+             by default). Every worker has a deque of intervals: when an interval
+             has to be refined it pushes the left half and keeps refining the
+             right one, idle workers steal the oldest (widest) intervals from the
+             others. Intervals deeper than TASKDEPTH halvings are refined
+             recursively by the worker that holds them. Each worker sums its own
+             areas and the sums are added when the pool stops.
+
+             "batched" refines breadth first instead: a level holds every interval
+             still failing the tolerance as arrays, each worker evaluates the
+             midpoints of its strip in one SIMD loop (AVX2 or AVX-512, picked at
+             startup) and writes the halves that must be refined further into the
+             next level, after a prefix sum over the workers' counts.
+
+             "simpson", "kronrod" and "romberg" use the engine in integrate.h
+             instead: the higher order rule is refined globally where the error
+             estimate is largest until the whole quadrant is within epsilon. The
+             error estimate and the number of evaluations are printed.
+
+             "batch" integrates many problems instead of one, read as lines
+             "a b r" (the quarter circle of radius r from a to b, r is 1 when left
+             out) from a file or stdin. The main thread parses the next chunk of
+             BATCHCHUNK problems while the workers integrate the current one,
+             claiming CLAIMSIZE problems at a time, then helps them. Every worker
+             integrates on its own thread with its own integrate.h arena, so no
+             problem allocates, and formats its results into fixed slots that are
+             written in input order. The integrals per second go to stderr.
+
+             "check" tests integrate.h: on 1/sqrt(x), which is infinite at 0,
+             kronrod has to converge to 2 and simpson and romberg have to stop
+             on the non-finite error estimate. Every rule has to converge on the
+             quarter circle. It exits with 1 if one fails.
+
    usage under Linux:
      gcc pi.c -o pi -lpthread -lm
-     ./pi numberOfThreads
+     ./pi [numberOfThreads [epsilon [tasks|batched|simpson|kronrod|romberg]]]
+     ./pi batch [numberOfThreads [epsilon [simpson|kronrod|romberg [problems]]]] > areas
+     ./pi check
 
 */
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <unistd.h>
 #include <sys/time.h>
 #include <pthread.h>
 #include <math.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "integrate.h"
 
 //epsilon value defines how many times the program is recursivly run. If epsilon is small the number of subintervals are high
 #define EPSILON 0.00000000001
-#define MAXWORKERS 10
+#define MAXWORKERS 128
+#define DEQUESIZE 4096   /* intervals a deque can hold, a full deque refines the interval itself */
+#define TASKDEPTH 24     /* intervals up to this many halvings deep are stealable tasks */
+#define CACHELINE 64
+#define BATCHCHUNK 16384 /* problems the batch mode reads at a time */
+#define CLAIMSIZE 64     /* problems a worker claims at a time */
+#define RESULTWIDTH 48   /* characters of a formatted result */
+
+int numWorkers;
+double epsilon;
+
+enum mode {TASKS, BATCHED, RULE};
+const char *modeNames[] = {"tasks", "batched"};
+enum mode mode = TASKS;
+enum integration_rule rule;   /* the rule of integrate.h in RULE mode */
+
+/* A work stealing deque (Chase and Lev) of intervals. The owner pushes and pops at the
+   bottom, thieves take them from the top. The fields are atomic so that a thief can read
+   a slot while the owner writes it, a thief that read a stale slot loses the race on top */
+struct interval {
+  _Atomic double a, b, fa, fb, area;
+  _Atomic int depth;
+};
 
-int numThreads;
+struct deque {
+  _Alignas(CACHELINE) atomic_long top;
+  _Alignas(CACHELINE) atomic_long bottom;
+  struct interval tasks[DEQUESIZE];
+};
 
-//As pthread_create only takes one argument for the starting function, we need a struct to store multiple arguments
-struct quadargs {
+//The area a worker has summed, one cache line each so the workers don't share lines
+struct partial {
+  _Alignas(CACHELINE) double area;
+  long refine, offset;   /* intervals of its strip to refine and where their halves go */
+};
 
-  double a, b, fa, fb, area, answer;
+struct deque deques[MAXWORKERS];
+struct partial partials[MAXWORKERS];
+atomic_long pendingTasks;   /* intervals pushed or being refined that are not summed yet */
 
+//A task popped or stolen out of a deque
+struct task {
+  double a, b, fa, fb, area;
+  int depth;
 };
 
 double f(double x);
-void* start_quad(void *init);
 double read_timer();
 
 double start_time, end_time; /* start and end times */
@@ -70,65 +147,553 @@ double quad(double a, double b, double fa, double fb, double area){
   rightarea = ((fm + fb)*(b-m))/2;
 
   //check if absolute value of the difference between the two areas are larger than epsilon.
-  if (fabs((leftarea + rightarea) - area) > EPSILON) {
+  if (fabs((leftarea + rightarea) - area) > epsilon) {
+
+    //Calculate the area sequentially
+    leftarea = quad(a, m, fa, fm, leftarea);
+    rightarea = quad(m, b, fm, fb, rightarea);
+  }
+  //return the calculated area
+  return (leftarea + rightarea);
+}
 
-    struct quadargs arg = {a, m, fa, fm, leftarea, 0.0};
+//Push an interval on the bottom of my deque, returns false if the deque is full
+bool pushTask(long myid, struct task *task){
+  struct deque *d = &deques[myid];
+  long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+  long t = atomic_load_explicit(&d->top, memory_order_acquire);
+  if (b - t >= DEQUESIZE) return false;
+
+  struct interval *slot = &d->tasks[b % DEQUESIZE];
+  atomic_store_explicit(&slot->a, task->a, memory_order_relaxed);
+  atomic_store_explicit(&slot->b, task->b, memory_order_relaxed);
+  atomic_store_explicit(&slot->fa, task->fa, memory_order_relaxed);
+  atomic_store_explicit(&slot->fb, task->fb, memory_order_relaxed);
+  atomic_store_explicit(&slot->area, task->area, memory_order_relaxed);
+  atomic_store_explicit(&slot->depth, task->depth, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+  return true;
+}
 
-    //run by creating new threads each recursive call ad
-    //decrement the number fo threads each reqursive call and enter the if statement only when numThreads > 0
-    if (numThreads-->0) {
+//Copy an interval out of a deque slot
+void readTask(struct interval *slot, struct task *task){
+  task->a = atomic_load_explicit(&slot->a, memory_order_relaxed);
+  task->b = atomic_load_explicit(&slot->b, memory_order_relaxed);
+  task->fa = atomic_load_explicit(&slot->fa, memory_order_relaxed);
+  task->fb = atomic_load_explicit(&slot->fb, memory_order_relaxed);
+  task->area = atomic_load_explicit(&slot->area, memory_order_relaxed);
+  task->depth = atomic_load_explicit(&slot->depth, memory_order_relaxed);
+}
 
-      pthread_t thread1;
+//Pop the newest interval from the bottom of my deque
+bool popTask(long myid, struct task *task){
+  struct deque *d = &deques[myid];
+  long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+  atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  long t = atomic_load_explicit(&d->top, memory_order_relaxed);
+  bool found = true;
+
+  if (t <= b) {
+    readTask(&d->tasks[b % DEQUESIZE], task);
+    if (t == b) {
+      //Last interval, a thief may want it as well
+      found = atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+      atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+  }
+  else {
+    found = false;
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+  }
+  return found;
+}
 
-      //Create a thread that starts execution in start_quad function with arg as argument. This calculates the left area.
-      pthread_create(&thread1, 0, start_quad, &arg);
+//Steal the oldest interval from the top of the deque of another worker
+bool stealTask(long victim, struct task *task){
+  struct deque *d = &deques[victim];
+  long t = atomic_load_explicit(&d->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
 
-      //Calculate the right area
-      rightarea = quad(m, b, fm, fb, rightarea);
-      pthread_join(thread1, NULL);
+  if (t >= b) return false;
+  readTask(&d->tasks[t % DEQUESIZE], task);
+  return atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+}
 
-      //Save the answer in the struct
-      leftarea = arg.answer;
-   }
+//Method for refining an interval as a task. Every refinement pushes the left half so that
+//other workers can steal it, and the worker continues with the right half
+void run_task(long myid, struct task task){
+  double area = 0;
+
+  while (task.depth < TASKDEPTH) {
+    double m = (task.a + task.b)/2;
+    double fm = f(m);
+    double leftarea = ((task.fa + fm)*(m - task.a))/2;
+    double rightarea = ((fm + task.fb)*(task.b - m))/2;
+
+    //The interval is accurate enough, its two halves are final
+    if (fabs((leftarea + rightarea) - task.area) <= epsilon) {
+      area += leftarea + rightarea;
+      break;
+    }
 
-    else{
-      //Calculate the area sequentially
-      leftarea = quad(a, m, fa, fm, leftarea);
-      rightarea = quad(m, b, fm, fb, rightarea);
+    struct task left = {task.a, m, task.fa, fm, leftarea, task.depth + 1};
+    atomic_fetch_add(&pendingTasks, 1);
+    if (!pushTask(myid, &left)) {
+      atomic_fetch_sub(&pendingTasks, 1);
+      area += quad(left.a, left.b, left.fa, left.fb, left.area);
     }
+    task = (struct task) {m, task.b, fm, task.fb, rightarea, task.depth + 1};
   }
-  //return the calculated area
-  return (leftarea + rightarea);
+
+  //Deep intervals are refined by this worker alone
+  if (task.depth >= TASKDEPTH)
+    area += quad(task.a, task.b, task.fa, task.fb, task.area);
+
+  partials[myid].area += area;
+  atomic_fetch_sub(&pendingTasks, 1);
 }
 
-//Function for getten arguments from the struct and calling quad with those arguments
-void* start_quad(void *init){
+//Run intervals from my own deque, steal when it is empty, and stop when every interval is summed
+void *quad_worker(void *arg){
+  long myid = (long) arg;
+  long victim = myid;
+  struct task task;
 
-  struct quadargs *params = init;
-  params->answer = quad(params->a, params->b, params->fa, params->fb, params->area);
+  while (atomic_load(&pendingTasks) > 0) {
+    if (popTask(myid, &task)) {
+      run_task(myid, task);
+      continue;
+    }
+
+    //Try every other worker once, then give the cpu away
+    bool stolen = false;
+    for (int tries = 1; tries < numWorkers && !stolen; tries++) {
+      victim = (victim + 1) % numWorkers;
+      if (victim != myid) stolen = stealTask(victim, &task);
+    }
+    if (stolen)
+      run_task(myid, task);
+    else
+      sched_yield();
+  }
   return NULL;
 }
 
+//Integrate f over [a, b] on numWorkers workers, the calling thread being worker 0
+double parallel_quad(double a, double b){
+  pthread_t workers[MAXWORKERS];
+  struct task whole = {a, b, f(a), f(b), ((f(b) + f(a))*(b - a))/2, 0};
+  double area = 0;
+  long l;
+
+  for (l = 0; l < numWorkers; l++) partials[l].area = 0;
+  atomic_store(&pendingTasks, 1);
+  pushTask(0, &whole);
+
+  for (l = 1; l < numWorkers; l++)
+    pthread_create(&workers[l], NULL, quad_worker, (void *) l);
+  quad_worker((void *) 0);
+  for (l = 1; l < numWorkers; l++)
+    pthread_join(workers[l], NULL);
+
+  for (l = 0; l < numWorkers; l++) area += partials[l].area;
+  return area;
+}
+
+/* Breadth first refinement. A level holds the intervals still to refine as one array per
+   field, so that the midpoints of a whole strip are evaluated by one vector loop */
+struct level {
+  double *a, *b, *fa, *fb, *area;
+  double *m, *fm;        /* midpoints and f at them */
+  long n, size;
+};
+
+struct level levels[2];
+pthread_barrier_t barrier;
+
+#define STRIPFIRST(n, id) ((n) * (id) / numWorkers)
+
+//Make room for n intervals in a level
+void grow_level(struct level *l, long n){
+  if (n <= l->size) return;
+  l->size = (n > 2 * l->size)? n : 2 * l->size;
+  double **fields[] = {&l->a, &l->b, &l->fa, &l->fb, &l->area, &l->m, &l->fm};
+  for (int k = 0; k < 7; k++)
+    *fields[k] = realloc(*fields[k], l->size * sizeof(double));
+}
+
+//Evaluate f at the midpoints of n intervals, one at a time
+void midpoints_scalar(const double *a, const double *b, double *m, double *fm, long n){
+  for (long i = 0; i < n; i++) {
+    m[i] = (a[i] + b[i])/2;
+    fm[i] = f(m[i]);
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//The same with four midpoints per instruction. No fma, so the results equal f() exactly
+__attribute__((target("avx2")))
+void midpoints_avx2(const double *a, const double *b, double *m, double *fm, long n){
+  __m256d half = _mm256_set1_pd(0.5), one = _mm256_set1_pd(1.0);
+  long i = 0;
+
+  for (; i + 4 <= n; i += 4) {
+    __m256d x = _mm256_mul_pd(_mm256_add_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)), half);
+    _mm256_storeu_pd(m + i, x);
+    _mm256_storeu_pd(fm + i, _mm256_sqrt_pd(_mm256_sub_pd(one, _mm256_mul_pd(x, x))));
+  }
+  midpoints_scalar(a + i, b + i, m + i, fm + i, n - i);
+}
+
+//And eight
+__attribute__((target("avx512f")))
+void midpoints_avx512(const double *a, const double *b, double *m, double *fm, long n){
+  __m512d half = _mm512_set1_pd(0.5), one = _mm512_set1_pd(1.0);
+  long i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    __m512d x = _mm512_mul_pd(_mm512_add_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i)), half);
+    _mm512_storeu_pd(m + i, x);
+    _mm512_storeu_pd(fm + i, _mm512_sqrt_pd(_mm512_sub_pd(one, _mm512_mul_pd(x, x))));
+  }
+  midpoints_scalar(a + i, b + i, m + i, fm + i, n - i);
+}
+#endif
+
+/* the midpoint kernel, picked once at startup for the cpu we run on */
+void (*midpointKernel)(const double *a, const double *b, double *m, double *fm, long n) = midpoints_scalar;
+const char *kernelName = "scalar";
+
+void init_kernels(){
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    midpointKernel = midpoints_avx512; kernelName = "avx512";
+  } else if (__builtin_cpu_supports("avx2")) {
+    midpointKernel = midpoints_avx2; kernelName = "avx2";
+  }
+#endif
+}
+
+//Refine the levels until no interval is left. Every worker takes an equal strip of each
+//level, and the halves it has to refine are written after those of the workers before it
+void *batch_worker(void *arg){
+  long myid = (long) arg;
+  int current = 0;
+
+  while (levels[current].n > 0) {
+    struct level *now = &levels[current], *next = &levels[!current];
+    long first = STRIPFIRST(now->n, myid), last = STRIPFIRST(now->n, myid + 1);
+    long i, refine = 0;
+    double area = 0;
+
+    //Evaluate the strip, sum the intervals that are accurate enough and count the others
+    midpointKernel(now->a + first, now->b + first, now->m + first, now->fm + first, last - first);
+    for (i = first; i < last; i++) {
+      double leftarea = ((now->fa[i] + now->fm[i])*(now->m[i] - now->a[i]))/2;
+      double rightarea = ((now->fm[i] + now->fb[i])*(now->b[i] - now->m[i]))/2;
+      if (fabs((leftarea + rightarea) - now->area[i]) <= epsilon)
+        area += leftarea + rightarea;
+      else
+        refine++;
+    }
+    partials[myid].area += area;
+    partials[myid].refine = refine;
+
+    //One worker places the strips of the next level
+    if (pthread_barrier_wait(&barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+      long total = 0;
+      for (long w = 0; w < numWorkers; w++) {
+        partials[w].offset = total;
+        total += 2 * partials[w].refine;
+      }
+      grow_level(next, total);
+      next->n = total;
+    }
+    pthread_barrier_wait(&barrier);
+
+    //Write both halves of every interval that failed
+    long out = partials[myid].offset;
+    for (i = first; i < last; i++) {
+      double leftarea = ((now->fa[i] + now->fm[i])*(now->m[i] - now->a[i]))/2;
+      double rightarea = ((now->fm[i] + now->fb[i])*(now->b[i] - now->m[i]))/2;
+      if (fabs((leftarea + rightarea) - now->area[i]) <= epsilon) continue;
+
+      next->a[out] = now->a[i]; next->b[out] = now->m[i];
+      next->fa[out] = now->fa[i]; next->fb[out] = now->fm[i]; next->area[out] = leftarea;
+      out++;
+      next->a[out] = now->m[i]; next->b[out] = now->b[i];
+      next->fa[out] = now->fm[i]; next->fb[out] = now->fb[i]; next->area[out] = rightarea;
+      out++;
+    }
+    pthread_barrier_wait(&barrier);
+    current = !current;
+  }
+  return NULL;
+}
+
+//Integrate f over [a, b] breadth first on numWorkers workers, the calling thread being worker 0
+double batched_quad(double a, double b){
+  pthread_t workers[MAXWORKERS];
+  double area = 0;
+  long l;
+
+  grow_level(&levels[0], 1);
+  levels[0].a[0] = a; levels[0].b[0] = b;
+  levels[0].fa[0] = f(a); levels[0].fb[0] = f(b);
+  levels[0].area[0] = ((f(b) + f(a))*(b - a))/2;
+  levels[0].n = 1;
+  for (l = 0; l < numWorkers; l++) partials[l].area = 0;
+  pthread_barrier_init(&barrier, NULL, numWorkers);
+
+  for (l = 1; l < numWorkers; l++)
+    pthread_create(&workers[l], NULL, batch_worker, (void *) l);
+  batch_worker((void *) 0);
+  for (l = 1; l < numWorkers; l++)
+    pthread_join(workers[l], NULL);
+
+  pthread_barrier_destroy(&barrier);
+  for (l = 0; l < numWorkers; l++) area += partials[l].area;
+  return area;
+}
+
 //calculate y value using pythagoras theorem
 double f(double x){
 
-  //f(x) = sqrt(1-x^2)
-  return sqrt(1-pow(x, 2));
+  //f(x) = sqrt(1-x^2), x*x rather than pow(x, 2) which is a libm call
+  return sqrt(1-x*x);
+}
+
+//f as an integrand of integrate.h
+double circle(double x, void *params){
+  (void) params;
+  return f(x);
+}
+
+//1/sqrt(x), which is infinite at 0
+double inverse_sqrt(double x, void *params){
+  (void) params;
+  return 1/sqrt(x);
+}
+
+//Check integrate.h on 1/sqrt(x) over [0, 1]. Kronrod doesn't evaluate the endpoints and has
+//to converge to 2, Simpson and Romberg evaluate f at 0 and have to stop unconverged on the
+//non-finite error estimate rather than by running out of regions. Every rule has to converge
+//on the quarter circle
+int check(){
+  bool passed = true;
+
+  for (int r = SIMPSON; r <= ROMBERG; r++) {
+    struct integral singular, quadrant;
+    integrate(inverse_sqrt, NULL, 0, 1, r, 1e-10, 2, &singular);
+    integrate(circle, NULL, 0, 1, r, 1e-10, 2, &quadrant);
+
+    bool singularOk;
+    const char *expected;
+    if (r == KRONROD) {
+      singularOk = singular.converged && fabs(singular.value - 2) < 1e-8;
+      expected = "converges to 2";
+    }
+    else {
+      singularOk = !singular.converged && !isfinite(singular.error);
+      expected = "stops on a non-finite error estimate";
+    }
+    bool ok = singularOk && quadrant.converged && fabs(4 * quadrant.value - M_PI) < 1e-8;
+    printf("%-8s 1/sqrt(x) over [0, 1]: %g, error %g, %s (%s), 4 * quarter circle: %.12f  %s\n",
+           ruleNames[r], singular.value, singular.error, singular.converged? "converged" : "not converged",
+           expected, 4 * quadrant.value, ok? "ok" : "FAILED");
+    passed &= ok;
+  }
+  return passed? 0 : 1;
+}
+
+/* Batch mode. A chunk holds the parsed problems and, once they are integrated, their
+   results as text, so that writing them is one copy per line */
+struct problem {
+  double a, b, r;
+  bool valid;
+};
+
+struct chunk {
+  struct problem problems[BATCHCHUNK];
+  char results[BATCHCHUNK][RESULTWIDTH];
+  unsigned char lengths[BATCHCHUNK];
+  long n;
+};
+
+struct chunk chunks[2];
+struct chunk *computing;    /* the chunk the workers integrate */
+atomic_long nextProblem;    /* first problem of computing not claimed yet */
+bool batchDone;
+
+//The quarter circle of radius *params
+double circle_radius(double x, void *params){
+  double r = *(double *) params;
+  return sqrt(r*r - x*x);
+}
+
+//Parse up to BATCHCHUNK lines into *line, which getline grows to the longest line. A line
+//that isn't a problem, or whose bounds lie outside [-r, r] where the circle is nan, gets a
+//nan result. So does a radius whose square overflows
+long read_problems(FILE *in, struct chunk *c, char **line, size_t *size){
+  char *end, *next, *last;
+
+  c->n = 0;
+  while (c->n < BATCHCHUNK && getline(line, size, in) >= 0) {
+    struct problem *p = &c->problems[c->n++];
+    p->a = strtod(*line, &end);
+    p->b = strtod(end, &next);
+    p->r = strtod(next, &last);
+    if (last == next) p->r = 1;
+    p->valid = next > end && fabs(p->a) <= p->r && fabs(p->b) <= p->r && isfinite(p->r * p->r);
+  }
+  return c->n;
+}
+
+//Integrate problems of the computing chunk until none are left to claim
+void integrate_chunk(struct integration_arena *arena){
+  struct chunk *c = computing;
+  struct integral result;
+  long first, i;
+
+  while ((first = atomic_fetch_add(&nextProblem, CLAIMSIZE)) < c->n) {
+    long last = (first + CLAIMSIZE < c->n)? first + CLAIMSIZE : c->n;
+    for (i = first; i < last; i++) {
+      struct problem *p = &c->problems[i];
+      if (p->valid) {
+        integrate_serial(arena, circle_radius, &p->r, p->a, p->b, rule, epsilon, &result);
+        c->lengths[i] = snprintf(c->results[i], RESULTWIDTH, "%.15g %.3g\n", result.value, result.error);
+      }
+      else
+        c->lengths[i] = snprintf(c->results[i], RESULTWIDTH, "nan nan\n");
+    }
+  }
+}
+
+void *batch_worker_thread(void *arg){
+  struct integration_arena arena;
+
+  (void) arg;
+
+  integrate_arena_init(&arena, 1);
+  for (;;) {
+    pthread_barrier_wait(&barrier);
+    if (batchDone) break;
+    integrate_chunk(&arena);
+    pthread_barrier_wait(&barrier);
+  }
+  integrate_arena_free(&arena);
+  return NULL;
+}
+
+//Integrate every problem of the input, the calling thread being worker 0 and the reader
+int batch(int argc, char *argv[]){
+  pthread_t workers[MAXWORKERS];
+  struct integration_arena arena;
+  FILE *in = stdin;
+  char *line = NULL;
+  size_t lineSize = 0;
+  long l, total = 0;
+  int current = 0;
+
+  numWorkers = (argc > 2)? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+  if (numWorkers < 1) numWorkers = 1;
+  if (numWorkers > MAXWORKERS) numWorkers = MAXWORKERS;
+  epsilon = (argc > 3)? atof(argv[3]) : EPSILON;
+  rule = KRONROD;
+  for (int r = SIMPSON; r <= ROMBERG; r++)
+    if (argc > 4 && strcmp(argv[4], ruleNames[r]) == 0) rule = r;
+  if (argc > 5 && !(in = fopen(argv[5], "r"))) {
+    perror(argv[5]);
+    return 1;
+  }
+
+  integrate_arena_init(&arena, 1);
+  pthread_barrier_init(&barrier, NULL, numWorkers);
+  for (l = 1; l < numWorkers; l++)
+    pthread_create(&workers[l], NULL, batch_worker_thread, NULL);
+
+  start_time = read_timer();
+  read_problems(in, &chunks[0], &line, &lineSize);
+  while (chunks[current].n > 0) {
+    struct chunk *c = &chunks[current];
+    computing = c;
+    atomic_store(&nextProblem, 0);
+    pthread_barrier_wait(&barrier);
+
+    //Read the next chunk while the others integrate, then help them
+    read_problems(in, &chunks[!current], &line, &lineSize);
+    integrate_chunk(&arena);
+    pthread_barrier_wait(&barrier);
+
+    for (l = 0; l < c->n; l++)
+      fwrite(c->results[l], 1, c->lengths[l], stdout);
+    total += c->n;
+    current = !current;
+  }
+  fflush(stdout);
+  end_time = read_timer();
+
+  batchDone = true;
+  pthread_barrier_wait(&barrier);
+  for (l = 1; l < numWorkers; l++)
+    pthread_join(workers[l], NULL);
+  pthread_barrier_destroy(&barrier);
+  integrate_arena_free(&arena);
+  if (in != stdin) fclose(in);
+  free(line);
+
+  fprintf(stderr, "Integrated %ld integrals with %s in %g sec, %g integrals per sec\n",
+          total, ruleNames[rule], end_time - start_time, total / (end_time - start_time));
+  return 0;
 }
 
 int main(int argc, char *argv[]) {
 
-  //Get number of threads from argument 1
-  numThreads = (argc > 1)? atoi(argv[1]) : MAXWORKERS;
+  if (argc > 1 && strcmp(argv[1], "batch") == 0)
+    return batch(argc, argv);
+  if (argc > 1 && strcmp(argv[1], "check") == 0)
+    return check();
+
+  //Get number of threads from argument 1, one per cpu by default, and epsilon from argument 2
+  numWorkers = (argc > 1)? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+  if (numWorkers < 1) numWorkers = 1;
+  if (numWorkers > MAXWORKERS) numWorkers = MAXWORKERS;
+  epsilon = (argc > 2)? atof(argv[2]) : EPSILON;
+  if (argc > 3 && strcmp(argv[3], "batched") == 0) mode = BATCHED;
+  for (int r = SIMPSON; r <= ROMBERG; r++)
+    if (argc > 3 && strcmp(argv[3], ruleNames[r]) == 0) {
+      mode = RULE;
+      rule = r;
+    }
+  init_kernels();
 
   start_time = read_timer();
 
   //set values to get the area in the first quadrant of unit circle and multiply by four to get the area of the whole circle
-  double pi = 4 * quad(0, 1, f(0), f(1), ((f(1)+f(0))*(1-0))/2);
+  struct integral quadrant;
+  double pi;
+  if (mode == RULE) {
+    integrate(circle, NULL, 0, 1, rule, epsilon, numWorkers, &quadrant);
+    pi = 4 * quadrant.value;
+  }
+  else
+    pi = 4 * ((mode == BATCHED)? batched_quad(0, 1) : parallel_quad(0, 1));
   end_time = read_timer();
 
   //10 decimal accuracy
   printf("\n\nPi is approximately %.10f\n", pi);
+  if (mode == RULE)
+    printf("\n\nRefined globally with %s: error estimate %g%s, %ld evaluations, %ld regions\n",
+           ruleNames[rule], 4 * quadrant.error, quadrant.converged? "" : " (not converged)",
+           quadrant.evaluations, quadrant.regions);
+  else if (mode == BATCHED)
+    printf("\n\nRefined breadth first with %s midpoints\n", kernelName);
+  else
+    printf("\n\nRefined by %s\n", modeNames[mode]);
 
   printf("\n\nThe execution time is %g sec\n", end_time - start_time);
   printf("\n\n");
@@ -4,31 +4,108 @@
              with random numbers. The array is of the size specified when
              running the code.
 
+             A fixed pool of workers (one per cpu by default) sorts the array.
+             Every worker has a deque of ranges: after a partition it pushes the
+             larger side and keeps partitioning the smaller one, idle workers
+             steal the oldest (largest) ranges from the others. Ranges smaller
+             than CUTOFF are sorted sequentially.
+
+             Partitions split around a median-of-3 (ninther for larger ranges)
+             pivot with a branchless BlockQuicksort kernel, or an AVX2/AVX-512 one
+             picked at startup. A second pass gathers the keys equal to the pivot
+             when the samples show it is duplicated, so duplicate keys don't
+             degenerate the recursion. "kernels" times every kernel on the array.
+             The pivot choice, the kernels and the benchmark driver below are in
+             sortKernels.h, which the OpenMP version includes as well.
+             When all keys fall in a range smaller than COUNTRANGE (and the array)
+             the array is counting sorted in parallel instead.
+
+             The top levels, ranges above PARALLELCUTOFF and a 1/4 worker share of
+             the array, are partitioned by all workers together: each partitions
+             its own block, then the misplaced elements are swapped across the
+             boundary in parallel. They run on the same pool as the rest of the
+             sort, the workers step through them between barriers.
+
+             The radix engine is an LSD radix sort instead, with per worker digit
+             histograms and a scatter through write combining buffers. The digit
+             width adapts to the range of the keys. "both" sorts copies of the
+             same array with each engine and compares the times.
+
+             The sample engine buckets the keys by oversampled splitters in one
+             pass and each worker sorts one bucket. The merge engine has every
+             worker sort its strip and then merge an equal share of the output
+             out of all strips. Neither has a serial top level.
+
+             "external" sorts a binary file of ints that doesn't fit in memory:
+             runs of half the memory budget are sorted by the engine while the
+             next one is read, then every worker merges an equal part of the
+             output out of all runs with a loser tree. The time and MB/s of
+             each phase are reported. "save" writes such a file.
+
+             "bench" runs every engine over uniform, sorted, reverse, few-unique
+             (99 keys), organ-pipe and Zipf inputs for the given sizes and worker
+             counts, with a warmup run, and prints min, p10, median, p90 and max
+             times as CSV after checking each output is a sorted permutation.
+
    usage under Linux:
-     gcc quicksort.c -o quicksort -lpthread
-     ./quicksort size
+     gcc -O2 quicksort.c -o quicksort -lpthread
+     ./quicksort size numWorkers kernels
+     ./quicksort size [numWorkers [quick|radix|sample|merge|both]]
+     ./quicksort save path size
+     ./quicksort external input output [memoryMB [numWorkers [quick|radix|sample|merge]]]
+     ./quicksort bench [size,size,... [workers,workers,... [runs]]] > results.csv
 
 */
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <sched.h>
 #include <time.h>
+#include <unistd.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include "sortKernels.h"
 
 #define MAXLENGTH 1000000
+#define MAXWORKERS 128
+#define CUTOFF 4096      /* ranges up to this size are sorted by one worker without tasks */
+#define DEQUESIZE 4096   /* ranges a deque can hold, a full deque sorts the range itself */
+#define CACHELINE 64
+#define COUNTRANGE 65536 /* arrays with fewer distinct key values than this are counting sorted */
+#define PARALLELCUTOFF 262144 /* ranges larger than this may be partitioned by all workers together */
+#define RADIXBITS 11     /* widest radix sort digit */
+#define COMBINESIZE 16   /* keys buffered per digit before they are written, one cache line */
+#define OVERSAMPLE 64    /* samples per sample sort bucket */
+#define EXTERNALMEMORY 256 /* default megabytes of buffers for the external sort */
 //#define DEBUG
 
 int length;
+int numWorkers;
 
-//Because pthread_create only send one argument to the specified function,
-//a structh as to be created to contain the necessary arguments
-struct sort_args{
-  int *array;
-  int left;
-  int right;
+enum sortengine {QUICK, RADIX, SAMPLE, MERGE, BOTH};
+const char *engineNames[] = {"quick", "radix", "sample", "merge", "both"};
+enum sortengine engine = QUICK;
+
+/* A work stealing deque (Chase and Lev). The owner pushes and pops ranges at the bottom,
+   thieves take them from the top. A range is packed into one word so that it can be
+   read while the owner writes the slot */
+struct deque {
+  _Alignas(CACHELINE) atomic_long top;
+  _Alignas(CACHELINE) atomic_long bottom;
+  _Atomic uint64_t tasks[DEQUESIZE];
 };
 
+struct deque deques[MAXWORKERS];
+int *sortArray;            /* the array the workers sort */
+atomic_long sortedCount;   /* elements that are in their final place */
+long sortLength;           /* number of elements to sort */
+
 /* timer */
 double read_timer() {
     static bool initialized = false;
@@ -44,92 +121,1077 @@ double read_timer() {
 
 double start_time, end_time; /* start and end times */
 
-//Swap two elemnets in an array
-void swap(int array[], int i, int j){
-  int temp = array[i];
-  array[i] = array[j];
-  array[j] = temp;
+//Method for sorting a range on the current thread. Recurses into the smaller side
+//only, so the stack stays logarithmic
+void serial_sort(int *array, int left, int right){
+  int lower, upper;
+
+  while (right > left) {
+    partition(array, left, right, &lower, &upper);
+    if (lower - left < right - upper) {
+      serial_sort(array, left, lower-1);
+      left = upper+1;
+    }
+    else {
+      serial_sort(array, upper+1, right);
+      right = lower-1;
+    }
+  }
+}
+
+#define PACK(left, right) (((uint64_t) (uint32_t) (right) << 32) | (uint32_t) (left))
+#define LEFT(task) ((int) (uint32_t) (task))
+#define RIGHT(task) ((int) ((task) >> 32))
+
+//Push a range on the bottom of my deque, returns false if the deque is full
+bool pushTask(long myid, int left, int right){
+  struct deque *d = &deques[myid];
+  long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+  long t = atomic_load_explicit(&d->top, memory_order_acquire);
+  if (b - t >= DEQUESIZE) return false;
+  atomic_store_explicit(&d->tasks[b % DEQUESIZE], PACK(left, right), memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+  return true;
 }
 
-//Method for partitioning
-int partition (int *array, int left, int right){
-  int i = left, j = right + 1;
-  while(1){
+//Pop the newest range from the bottom of my deque
+bool popTask(long myid, uint64_t *task){
+  struct deque *d = &deques[myid];
+  long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+  atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  long t = atomic_load_explicit(&d->top, memory_order_relaxed);
+  bool found = true;
 
-    /*Note: need a do while loop as this will cause i++/j-- to be executed at least once before checking if the condition is met */
+  if (t <= b) {
+    *task = atomic_load_explicit(&d->tasks[b % DEQUESIZE], memory_order_relaxed);
+    if (t == b) {
+      //Last range, a thief may want it as well
+      found = atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+      atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+  }
+  else {
+    found = false;
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+  }
+  return found;
+}
 
-    //while the element in position i is less than the pivot element, increment i
-    do i++; while(array[i] <= array[left] && i < right);
+//Steal the oldest range from the top of the deque of another worker
+bool stealTask(long victim, uint64_t *task){
+  struct deque *d = &deques[victim];
+  long t = atomic_load_explicit(&d->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
 
-    //While the element in position j is greater than the pivot element, decrement j
-    do j--; while (array[j] > array[left]);
+  if (t >= b) return false;
+  *task = atomic_load_explicit(&d->tasks[t % DEQUESIZE], memory_order_relaxed);
+  return atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+}
 
-    //Check if pointers cross. In that case, we are done with the partitioning => break from the loop
-    if (i >= j) break;
+//Method for sorting a range as a task. Every partition pushes the larger side so that
+//other workers can steal it, and the worker continues with the smaller side
+void run_task(long myid, int left, int right){
+  int *array = sortArray;
+  int lower, upper;
+
+  while (right - left + 1 > CUTOFF) {
+
+    //Partition the elements in the array. [lower, upper] holds the elements equal to the pivot
+    partition(array, left, right, &lower, &upper);
+    atomic_fetch_add(&sortedCount, upper - lower + 1);
+
+    if (lower - left > right - upper) {
+      if (!pushTask(myid, left, lower-1)) run_task(myid, left, lower-1);
+      left = upper+1;
+    }
+    else {
+      if (!pushTask(myid, upper+1, right)) run_task(myid, upper+1, right);
+      right = lower-1;
+    }
+  }
+  if (right >= left) {
+    serial_sort(array, left, right);
+    atomic_fetch_add(&sortedCount, right - left + 1);
+  }
+}
+
+//Run ranges from my own deque, steal when it is empty, and stop when every element is in place
+void *sort_worker(void *arg){
+  long myid = (long) arg;
+  long victim = myid;
+  uint64_t task;
+
+  while (atomic_load(&sortedCount) < sortLength) {
+    if (popTask(myid, &task)) {
+      run_task(myid, LEFT(task), RIGHT(task));
+      continue;
+    }
 
-    //If the pointers hasn't crossed yet, swap their positions
-    swap(array, i, j);
+    //Try every other worker once, then give the cpu away
+    bool stolen = false;
+    for (int tries = 1; tries < numWorkers && !stolen; tries++) {
+      victim = (victim + 1) % numWorkers;
+      if (victim != myid) stolen = stealTask(victim, &task);
+    }
+    if (stolen)
+      run_task(myid, LEFT(task), RIGHT(task));
+    else
+      sched_yield();
   }
-  //swap the pivot element with j.
-  swap(array, left, j);
+  return NULL;
+}
 
-  //return index
-  return j;
+//Run fn on numWorkers workers, the calling thread being worker 0
+void run_workers(void *(*fn)(void *)){
+  pthread_t workers[MAXWORKERS];
+  long l;
+
+  for (l = 1; l < numWorkers; l++)
+    pthread_create(&workers[l], NULL, fn, (void *) l);
+  fn((void *) 0);
+  for (l = 1; l < numWorkers; l++)
+    pthread_join(workers[l], NULL);
 }
 
-int numOfThreads = 3000;
+/* Steps of the sort that all workers of the running pool take together. Worker 0 picks
+   the step and the others wait for it in follow_steps, so a step costs two barriers
+   rather than creating and joining a thread per worker */
+void *(*poolStep)(void *);    /* the step, NULL ends follow_steps */
+pthread_barrier_t poolBarrier;
 
-/*
-void serial_sort(int *array, int left, int right){
+//Run fn on every worker of the pool, called by worker 0
+void pool_step(void *(*fn)(void *)){
+  poolStep = fn;
+  pthread_barrier_wait(&poolBarrier);
+  fn((void *) 0);
+  pthread_barrier_wait(&poolBarrier);
+}
+
+//Run the steps worker 0 picks until it ends them
+void follow_steps(long myid){
+  while (1) {
+    pthread_barrier_wait(&poolBarrier);
+    if (!poolStep) break;
+    poolStep((void *) myid);
+    pthread_barrier_wait(&poolBarrier);
+  }
+}
+
+//Let the workers waiting in follow_steps go on, called by worker 0
+void end_steps(){
+  poolStep = NULL;
+  pthread_barrier_wait(&poolBarrier);
+}
+
+/* Counting sort for arrays whose keys span a small range. Each worker scans its strip
+   for the smallest and largest key, then counts its strip into a private histogram.
+   The histograms are summed into key offsets and each worker writes its own slice of
+   the output, so no phase needs a lock */
+int minKeys[MAXWORKERS], maxKeys[MAXWORKERS];
+long *histograms;          /* numWorkers histograms of numKeys counts */
+long *keyOffsets;          /* first output position of every key, numKeys + 1 entries */
+int minKey, numKeys;
+
+#define STRIPFIRST(id) (sortLength * (id) / numWorkers)
+
+void *find_key_range(void *arg){
+  long myid = (long) arg;
+  int min = INT_MAX, max = INT_MIN;
+
+  for (long i = STRIPFIRST(myid); i < STRIPFIRST(myid + 1); i++) {
+    if (sortArray[i] < min) min = sortArray[i];
+    if (sortArray[i] > max) max = sortArray[i];
+  }
+  minKeys[myid] = min;
+  maxKeys[myid] = max;
+  return NULL;
+}
+
+void *count_keys(void *arg){
+  long myid = (long) arg;
+  long *counts = histograms + myid * numKeys;
+
+  for (long i = STRIPFIRST(myid); i < STRIPFIRST(myid + 1); i++)
+    counts[sortArray[i] - minKey]++;
+  return NULL;
+}
 
-  if (right > left) {
-    int j = partition(array, left, right);
-    serial_sort(array, left, j-1);
-    serial_sort(array, j+1, right);
+void *write_keys(void *arg){
+  long myid = (long) arg;
+  long first = STRIPFIRST(myid), last = STRIPFIRST(myid + 1);
+  int key = 0, high = numKeys;
+
+  //Find the key that covers my first output position
+  while (key + 1 < high) {
+    int mid = (key + high) / 2;
+    if (keyOffsets[mid] <= first) key = mid; else high = mid;
+  }
+  for (long i = first; i < last; key++) {
+    long end = (keyOffsets[key + 1] < last)? keyOffsets[key + 1] : last;
+    for (; i < end; i++)
+      sortArray[i] = minKey + key;
   }
-}*/
+  return NULL;
+}
+
+//Counting sort the array when its keys span fewer than COUNTRANGE values, returns false otherwise
+bool counting_sort(){
+  int min = INT_MAX, max = INT_MIN;
+  long l, k;
+
+  run_workers(find_key_range);
+  for (l = 0; l < numWorkers; l++) {
+    if (minKeys[l] < min) min = minKeys[l];
+    if (maxKeys[l] > max) max = maxKeys[l];
+  }
+  if ((long) max - min >= COUNTRANGE || (long) max - min >= sortLength)
+    return false;
+
+  minKey = min;
+  numKeys = max - min + 1;
+  histograms = calloc((size_t) numWorkers * numKeys, sizeof(long));
+  keyOffsets = malloc((numKeys + 1) * sizeof(long));
+  run_workers(count_keys);
+
+  keyOffsets[0] = 0;
+  for (k = 0; k < numKeys; k++) {
+    long count = 0;
+    for (l = 0; l < numWorkers; l++)
+      count += histograms[l * numKeys + k];
+    keyOffsets[k + 1] = keyOffsets[k] + count;
+  }
+  run_workers(write_keys);
+
+  free(histograms);
+  free(keyOffsets);
+  return true;
+}
 
-//Method for calling sort with the initial values
-void *start_sort(void *init){
+/* LSD radix sort. The keys are taken relative to the smallest one, and the digit width
+   is the one that covers their bits in the fewest passes of at most RADIXBITS bits. Every
+   pass counts the digits of each worker's strip into a private histogram, turns the
+   histograms into output positions (digit major, worker minor, so the sort is stable)
+   and scatters. The scatter goes through a cache line sized buffer per digit so that
+   the stores to the output are whole lines instead of single elements */
+int *radixSource, *radixTarget;
+long *digitOffsets;          /* numWorkers rows of numDigits counts, then positions */
+int *combineBuffers;         /* numWorkers * numDigits * COMBINESIZE elements */
+int numDigits, digitShift;
 
-  struct sort_args *start = init;
-  sort(start->array, start->left, start->right);
+#define DIGIT(key) ((((unsigned) (key) - (unsigned) minKey) >> digitShift) & (numDigits - 1))
 
+void *count_digits(void *arg){
+  long myid = (long) arg;
+  long *counts = digitOffsets + myid * numDigits;
+
+  for (int d = 0; d < numDigits; d++) counts[d] = 0;
+  for (long i = STRIPFIRST(myid); i < STRIPFIRST(myid + 1); i++)
+    counts[DIGIT(radixSource[i])]++;
+  return NULL;
+}
+
+void *scatter_digits(void *arg){
+  long myid = (long) arg;
+  long *offsets = digitOffsets + myid * numDigits;
+  int *buffers = combineBuffers + myid * numDigits * COMBINESIZE;
+  int fill[1 << RADIXBITS] = {0};
+  int d;
+
+  for (long i = STRIPFIRST(myid); i < STRIPFIRST(myid + 1); i++) {
+    int key = radixSource[i];
+    d = DIGIT(key);
+    buffers[d * COMBINESIZE + fill[d]++] = key;
+    if (fill[d] == COMBINESIZE) {
+      memcpy(radixTarget + offsets[d], buffers + d * COMBINESIZE, COMBINESIZE * sizeof(int));
+      offsets[d] += COMBINESIZE;
+      fill[d] = 0;
+    }
+  }
+  for (d = 0; d < numDigits; d++)
+    memcpy(radixTarget + offsets[d], buffers + d * COMBINESIZE, fill[d] * sizeof(int));
+  return NULL;
+}
+
+//Method for radix sorting the array [0, sortLength) of sortArray with all workers
+void radix_sort(){
+  int min = INT_MAX, max = INT_MIN, bits = 0, passes, l, d;
+
+  run_workers(find_key_range);
+  for (l = 0; l < numWorkers; l++) {
+    if (minKeys[l] < min) min = minKeys[l];
+    if (maxKeys[l] > max) max = maxKeys[l];
+  }
+  while (bits < 32 && ((unsigned) max - (unsigned) min) >> bits) bits++;
+  if (bits == 0) return;
+  passes = (bits + RADIXBITS - 1) / RADIXBITS;
+
+  minKey = min;
+  numDigits = 1 << ((bits + passes - 1) / passes);
+  radixSource = sortArray;
+  radixTarget = malloc(sortLength * sizeof(int));
+  digitOffsets = malloc((size_t) numWorkers * numDigits * sizeof(long));
+  combineBuffers = aligned_alloc(CACHELINE, (size_t) numWorkers * numDigits * COMBINESIZE * sizeof(int));
+
+  for (digitShift = 0; digitShift < bits; digitShift += (bits + passes - 1) / passes) {
+    run_workers(count_digits);
+
+    long position = 0;
+    for (d = 0; d < numDigits; d++) {
+      for (l = 0; l < numWorkers; l++) {
+        long count = digitOffsets[l * numDigits + d];
+        digitOffsets[l * numDigits + d] = position;
+        position += count;
+      }
+    }
+    run_workers(scatter_digits);
+
+    int *swap = radixSource;
+    radixSource = radixTarget;
+    radixTarget = swap;
+  }
+
+  //After an odd number of passes the sorted keys are in the scratch array
+  if (radixSource != sortArray) {
+    memcpy(sortArray, radixSource, sortLength * sizeof(int));
+    radixTarget = radixSource;
+  }
+  free(radixTarget);
+  free(digitOffsets);
+  free(combineBuffers);
+}
+
+//First position in [first, last) whose key is not less than key, or greater than key if after
+int search(int *array, int first, int last, long key, bool after){
+  while (first < last) {
+    int mid = first + (last - first) / 2;
+    if (array[mid] < key || (after && array[mid] == key)) first = mid + 1;
+    else last = mid;
+  }
+  return first;
+}
+
+/* Sample sort. A sorted oversample of the keys gives numWorkers - 1 splitters, each worker
+   finds the bucket of every key in its strip once, and the keys are scattered into the
+   buckets through the same per worker histogram prefix sums as the radix sort. Worker b
+   then sorts bucket b on its own and copies it back */
+int splitters[MAXWORKERS];
+unsigned char *bucketOf;               /* bucket of every key */
+long bucketStart[MAXWORKERS + 1];      /* first position of every bucket */
+int *scratch;
+
+void *bucket_keys(void *arg){
+  long myid = (long) arg;
+  long *counts = digitOffsets + myid * numWorkers;
+
+  for (int b = 0; b < numWorkers; b++) counts[b] = 0;
+  for (long i = STRIPFIRST(myid); i < STRIPFIRST(myid + 1); i++) {
+    int b = search(splitters, 0, numWorkers - 1, sortArray[i], true);
+    bucketOf[i] = b;
+    counts[b]++;
+  }
+  return NULL;
+}
+
+void *scatter_buckets(void *arg){
+  long myid = (long) arg;
+  long *offsets = digitOffsets + myid * numWorkers;
+
+  for (long i = STRIPFIRST(myid); i < STRIPFIRST(myid + 1); i++)
+    scratch[offsets[bucketOf[i]]++] = sortArray[i];
+  return NULL;
+}
+
+void *sort_bucket(void *arg){
+  long myid = (long) arg;
+  long first = bucketStart[myid], last = bucketStart[myid + 1];
+
+  serial_sort(scratch, first, last - 1);
+  memcpy(sortArray + first, scratch + first, (last - first) * sizeof(int));
+  return NULL;
+}
+
+//Method for sample sorting the array [0, sortLength) of sortArray with all workers
+void sample_sort(){
+  int samples = OVERSAMPLE * numWorkers, b, l;
+  int *sample = malloc(samples * sizeof(int));
+  uint64_t state = 0x9E3779B97F4A7C15;
+
+  //Pick the samples with a xorshift generator, so that rand() isn't disturbed
+  for (l = 0; l < samples; l++) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    sample[l] = sortArray[state % sortLength];
+  }
+  serial_sort(sample, 0, samples - 1);
+  for (b = 1; b < numWorkers; b++)
+    splitters[b - 1] = sample[b * OVERSAMPLE];
+  free(sample);
+
+  bucketOf = malloc(sortLength);
+  scratch = malloc(sortLength * sizeof(int));
+  digitOffsets = malloc((size_t) numWorkers * numWorkers * sizeof(long));
+  run_workers(bucket_keys);
+
+  long position = 0;
+  for (b = 0; b < numWorkers; b++) {
+    bucketStart[b] = position;
+    for (l = 0; l < numWorkers; l++) {
+      long count = digitOffsets[l * numWorkers + b];
+      digitOffsets[l * numWorkers + b] = position;
+      position += count;
+    }
+  }
+  bucketStart[numWorkers] = position;
+  run_workers(scatter_buckets);
+  run_workers(sort_bucket);
+
+  free(bucketOf);
+  free(scratch);
+  free(digitOffsets);
+}
+
+/* Multiway merge sort. Every worker sorts its strip, then the output is cut into equal
+   parts and worker k merges part k out of all the strips. The cut for a rank is found by
+   a binary search for the smallest key with at least rank keys at or below it, taking
+   keys equal to it from the strips in order so that the cuts of all parts agree */
+int stripEnd[MAXWORKERS];
+
+void *sort_strip(void *arg){
+  long myid = (long) arg;
+
+  serial_sort(sortArray, STRIPFIRST(myid), STRIPFIRST(myid + 1) - 1);
+  return NULL;
+}
+
+//Positions in every strip that put rank keys before them
+void cut_strips(long rank, int *cut){
+  long low = INT_MIN, high = INT_MAX, below;
+  int s;
+
+  while (low < high) {
+    long mid = (low + high) >> 1;
+    below = 0;
+    for (s = 0; s < numWorkers; s++)
+      below += search(sortArray, STRIPFIRST(s), stripEnd[s], mid, true) - STRIPFIRST(s);
+    if (below >= rank) high = mid; else low = mid + 1;
+  }
+
+  below = 0;
+  for (s = 0; s < numWorkers; s++) {
+    cut[s] = search(sortArray, STRIPFIRST(s), stripEnd[s], low, false);
+    below += cut[s] - STRIPFIRST(s);
+  }
+  for (s = 0; s < numWorkers && below < rank; s++) {
+    int equal = search(sortArray, cut[s], stripEnd[s], low, true) - cut[s];
+    int take = (rank - below < equal)? rank - below : equal;
+    cut[s] += take;
+    below += take;
+  }
+}
+
+void *merge_part(void *arg){
+  long myid = (long) arg;
+  int first[MAXWORKERS], last[MAXWORKERS], heap[MAXWORKERS];
+  int size = 0, s;
+  long out = STRIPFIRST(myid);
+
+  cut_strips(STRIPFIRST(myid), first);
+  cut_strips(STRIPFIRST(myid + 1), last);
+
+  //Binary min heap of the strips, ordered by their next key
+  #define HEAD(h) sortArray[first[heap[h]]]
+  for (s = 0; s < numWorkers; s++) {
+    if (first[s] == last[s]) continue;
+    int h = size++;
+    heap[h] = s;
+    while (h > 0 && HEAD(h) < HEAD((h - 1) / 2)) {
+      int parent = (h - 1) / 2, temp = heap[h];
+      heap[h] = heap[parent];
+      heap[parent] = temp;
+      h = parent;
+    }
+  }
+  while (size > 0) {
+    s = heap[0];
+    scratch[out++] = sortArray[first[s]++];
+    if (first[s] == last[s]) heap[0] = heap[--size];
+
+    int h = 0;
+    while (2 * h + 1 < size) {
+      int child = 2 * h + 1;
+      if (child + 1 < size && HEAD(child + 1) < HEAD(child)) child++;
+      if (HEAD(h) <= HEAD(child)) break;
+      int temp = heap[h];
+      heap[h] = heap[child];
+      heap[child] = temp;
+      h = child;
+    }
+  }
+  #undef HEAD
   return NULL;
 }
-//Method for sorting. This is the part that can be parallelized
+
+void *copy_part(void *arg){
+  long myid = (long) arg;
+  long first = STRIPFIRST(myid);
+
+  memcpy(sortArray + first, scratch + first, (STRIPFIRST(myid + 1) - first) * sizeof(int));
+  return NULL;
+}
+
+//Method for merge sorting the array [0, sortLength) of sortArray with all workers
+void merge_sort(){
+  for (int s = 0; s < numWorkers; s++)
+    stripEnd[s] = STRIPFIRST(s + 1);
+  scratch = malloc(sortLength * sizeof(int));
+  run_workers(sort_strip);
+  run_workers(merge_part);
+  run_workers(copy_part);
+  free(scratch);
+}
+
+/* Parallel partition for the top levels of the sort, where a single partition would leave
+   the other workers idle. Every worker partitions its own block of the range, which leaves
+   large elements left of the final boundary and small ones right of it. Both kinds are
+   listed as one interval per block, and the workers then swap equal shares of them */
+struct interval {
+  int first, last;
+};
+
+int *blockArray;
+int blockFirst, blockEnd;        /* the range [blockFirst, blockEnd) being partitioned */
+int blockPivot;
+bool blockStrict;                /* small means < pivot if true, <= pivot otherwise */
+int blockSplit[MAXWORKERS];      /* first large element of every block */
+struct interval misplacedLarge[MAXWORKERS], misplacedSmall[MAXWORKERS];
+long numMisplaced;
+int nextDeque;                   /* deque that gets the next top level range */
+
+#define BLOCKFIRST(id) (blockFirst + (int) ((long) (blockEnd - blockFirst) * (id) / numWorkers))
+
+bool is_small(int key){
+  return blockStrict? key < blockPivot : key <= blockPivot;
+}
+
+void *partition_block(void *arg){
+  long myid = (long) arg;
+  int i = BLOCKFIRST(myid), j = BLOCKFIRST(myid + 1) - 1;
+  int *array = blockArray;
+
+  while (1) {
+    while (i <= j && is_small(array[i])) i++;
+    while (i <= j && !is_small(array[j])) j--;
+    if (i >= j) break;
+    swap(array, i++, j--);
+  }
+  blockSplit[myid] = i;
+  return NULL;
+}
+
+//Find the element a number of places into a list of intervals
+void seek_interval(struct interval *list, long skip, int *index, int *position){
+  int l = 0;
+  while (skip >= list[l].last - list[l].first) {
+    skip -= list[l].last - list[l].first;
+    l++;
+  }
+  *index = l;
+  *position = list[l].first + (int) skip;
+}
+
+void *swap_misplaced(void *arg){
+  long myid = (long) arg;
+  long first = numMisplaced * myid / numWorkers, last = numMisplaced * (myid + 1) / numWorkers;
+  int large, small, i, j;
+
+  if (first >= last) return NULL;
+  seek_interval(misplacedLarge, first, &large, &i);
+  seek_interval(misplacedSmall, first, &small, &j);
+  for (long k = first; k < last; k++) {
+    while (i == misplacedLarge[large].last) i = misplacedLarge[++large].first;
+    while (j == misplacedSmall[small].last) j = misplacedSmall[++small].first;
+    swap(blockArray, i++, j++);
+  }
+  return NULL;
+}
+
+//Partition [left, right] with all workers, returns the first element that isn't small
+int parallel_partition(int *array, int left, int right, int pivot, bool strict){
+  int boundary = left;
+  long l;
+
+  blockArray = array;
+  blockFirst = left;
+  blockEnd = right + 1;
+  blockPivot = pivot;
+  blockStrict = strict;
+  pool_step(partition_block);
+
+  for (l = 0; l < numWorkers; l++)
+    boundary += blockSplit[l] - BLOCKFIRST(l);
+
+  numMisplaced = 0;
+  for (l = 0; l < numWorkers; l++) {
+    int first = BLOCKFIRST(l), end = BLOCKFIRST(l + 1);
+    misplacedLarge[l].first = blockSplit[l];
+    misplacedLarge[l].last = (end < boundary)? end : boundary;
+    if (misplacedLarge[l].last < misplacedLarge[l].first) misplacedLarge[l].last = misplacedLarge[l].first;
+    misplacedSmall[l].first = (first > boundary)? first : boundary;
+    misplacedSmall[l].last = blockSplit[l];
+    if (misplacedSmall[l].last < misplacedSmall[l].first) misplacedSmall[l].last = misplacedSmall[l].first;
+    numMisplaced += misplacedLarge[l].last - misplacedLarge[l].first;
+  }
+  pool_step(swap_misplaced);
+  return boundary;
+}
+
+//Partition the top levels in parallel until the ranges are at most threshold long, and
+//hand the ranges out to the deques round robin
+void partition_top(int *array, int left, int right, int threshold){
+  if (right < left) return;
+
+  if (right - left + 1 <= threshold) {
+    if (!pushTask(nextDeque, left, right)) {
+      serial_sort(array, left, right);
+      atomic_fetch_add(&sortedCount, right - left + 1);
+    }
+    nextDeque = (nextDeque + 1) % numWorkers;
+    return;
+  }
+
+  //Three-way split in two passes: < pivot first, then == pivot out of the rest
+  int pivot = array[choose_pivot(array, left, right, NULL)];
+  int lower = parallel_partition(array, left, right, pivot, true);
+  int upper = parallel_partition(array, lower, right, pivot, false) - 1;
+  atomic_fetch_add(&sortedCount, upper - lower + 1);
+
+  partition_top(array, left, lower-1, threshold);
+  partition_top(array, upper+1, right, threshold);
+}
+
+int topLeft, topRight, topThreshold;   /* the range sort() hands to the pool */
+
+//Partition the top levels with the whole pool, then sort the ranges from the deques
+void *top_worker(void *arg){
+  long myid = (long) arg;
+
+  if (myid == 0) {
+    partition_top(sortArray, topLeft, topRight, topThreshold);
+    end_steps();
+  }
+  else
+    follow_steps(myid);
+  return sort_worker(arg);
+}
+
+//Method for sorting. The calling thread is worker 0 of a fixed pool of numWorkers workers
 void sort(int *array, int left, int right){
-  if (right > left) {
+  long l;
+  int threshold = INT_MAX;
+
+  if (right <= left) return;
+  sortArray = array + left;
+  sortLength = right - left + 1;
+  if (counting_sort()) return;
+
+  sortArray = array;
+  atomic_store(&sortedCount, 0);
+  for (l = 0; l < numWorkers; l++) {
+    atomic_store(&deques[l].top, 0);
+    atomic_store(&deques[l].bottom, 0);
+  }
+
+  //Ranges above the threshold are partitioned by all workers, so that every worker has
+  //a range of its own from the start
+  if (numWorkers > 1) {
+    threshold = sortLength / (4 * numWorkers);
+    if (threshold < PARALLELCUTOFF) threshold = PARALLELCUTOFF;
+  }
+  nextDeque = 0;
+  topLeft = left;
+  topRight = right;
+  topThreshold = threshold;
+  pthread_barrier_init(&poolBarrier, NULL, numWorkers);
+  run_workers(top_worker);
+  pthread_barrier_destroy(&poolBarrier);
+}
+
+//Sort the whole array with one of the engines
+void sort_with(enum sortengine with, int *array){
+  if (with == QUICK) {
+    /*struct sort_args init = {array, 0, length - 1};
+    start_sort(&init);*/
+    sort(array, 0, length - 1);
+    return;
+  }
+
+  sortArray = array;
+  sortLength = length;
+  if (length < 2) return;
+  if (with == RADIX) radix_sort();
+  else if (with == SAMPLE) sample_sort();
+  else merge_sort();
+}
+
+/* External sort for files of keys larger than memory. Run generation reads the input in
+   chunks of half the memory budget: a reader thread fills one buffer while the workers
+   sort the other with the in-memory engine and write it out as a run. The merge then
+   cuts the output into one equal part per worker (the same key search as the merge
+   engine, on the run file) and every worker merges its part of all runs with a loser
+   tree, reading the runs and writing the output through buffers of its own */
+struct chunk {
+  int *keys;
+  long count;
+  bool full;      /* read and not yet sorted and written */
+};
+
+struct chunk chunks[2];
+pthread_mutex_t chunkLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t chunkChanged = PTHREAD_COND_INITIALIZER;
+int inputFd, runsFd, outputFd;
+long totalKeys, runKeys, mergeKeys;   /* keys in the input, in a run and in a merge buffer */
+int numRuns;
+double readWait;                      /* seconds the sort waited for the reader */
+
+//Read or write all of count bytes at offset, exits on an error
+void transfer(int fd, void *buffer, size_t count, off_t offset, bool write){
+  char *bytes = buffer;
+  while (count > 0) {
+    ssize_t done = write? pwrite(fd, bytes, count, offset) : pread(fd, bytes, count, offset);
+    if (done <= 0) {
+      perror(write? "pwrite" : "pread");
+      exit(1);
+    }
+    bytes += done;
+    offset += done;
+    count -= done;
+  }
+}
+
+void *read_chunks(void *arg){
+  (void) arg;
+  for (int r = 0; r < numRuns; r++) {
+    struct chunk *c = &chunks[r % 2];
+    long count = (totalKeys - r * runKeys < runKeys)? totalKeys - r * runKeys : runKeys;
+
+    pthread_mutex_lock(&chunkLock);
+    while (c->full) pthread_cond_wait(&chunkChanged, &chunkLock);
+    pthread_mutex_unlock(&chunkLock);
+
+    transfer(inputFd, c->keys, count * sizeof(int), r * runKeys * sizeof(int), false);
+
+    pthread_mutex_lock(&chunkLock);
+    c->count = count;
+    c->full = true;
+    pthread_cond_broadcast(&chunkChanged);
+    pthread_mutex_unlock(&chunkLock);
+  }
+  return NULL;
+}
+
+//Sort every chunk into a run while the reader fills the other buffer
+void generate_runs(){
+  pthread_t reader;
+
+  pthread_create(&reader, NULL, read_chunks, NULL);
+  for (int r = 0; r < numRuns; r++) {
+    struct chunk *c = &chunks[r % 2];
+
+    double wait = read_timer();
+    pthread_mutex_lock(&chunkLock);
+    while (!c->full) pthread_cond_wait(&chunkChanged, &chunkLock);
+    pthread_mutex_unlock(&chunkLock);
+    readWait += read_timer() - wait;
+
+    //The engines sort the first length keys of the array
+    length = c->count;
+    sort_with(engine, c->keys);
+    transfer(runsFd, c->keys, c->count * sizeof(int), r * runKeys * sizeof(int), true);
+
+    pthread_mutex_lock(&chunkLock);
+    c->full = false;
+    pthread_cond_broadcast(&chunkChanged);
+    pthread_mutex_unlock(&chunkLock);
+  }
+  pthread_join(reader, NULL);
+}
+
+#define RUNLENGTH(r) (((r) == numRuns - 1)? totalKeys - (r) * runKeys : runKeys)
+#define CUTBLOCK 1024   /* keys of a run read at once when the runs are cut */
+
+struct runblock {
+  int *keys;
+  long first, count;    /* the positions of the run in keys */
+};
+
+int run_key(int run, long i){
+  int key;
+  transfer(runsFd, &key, sizeof(int), (run * runKeys + i) * sizeof(int), false);
+  return key;
+}
+
+//First position in [first, last) of a run whose key is not less than key, or greater if after.
+//Probes the file one key at a time until the range fits in a block, then reads that block
+//once and searches it, and the later searches of the run, in memory
+long search_run(int run, long first, long last, long key, bool after, struct runblock *block){
+  while (first < last) {
+    long mid = first + (last - first) / 2;
+    int k;
+    if (first >= block->first && last <= block->first + block->count)
+      k = block->keys[mid - block->first];
+    else if (last - first <= CUTBLOCK) {
+      block->first = first;
+      block->count = (RUNLENGTH(run) - first < CUTBLOCK)? RUNLENGTH(run) - first : CUTBLOCK;
+      transfer(runsFd, block->keys, block->count * sizeof(int), (run * runKeys + first) * sizeof(int), false);
+      continue;
+    }
+    else k = run_key(run, mid);
+    if (k < key || (after && k == key)) first = mid + 1;
+    else last = mid;
+  }
+  return first;
+}
 
-    //Partition the elements in the array. "j" is the index of the pivot element
-    int j = partition(array, left, right);
+//Positions in every run that put rank keys before them. The key values are bisected while
+//every run keeps its positions of low and high, so its searches narrow down to one block.
+//The blocks are read into blocks, mergeKeys apart
+void cut_runs(long rank, long *cut, int *blocks){
+  long low = INT_MIN, high = INT_MAX, below;
+  long *upTo = malloc(numRuns * sizeof(long));      /* keys of every run not above high */
+  long *position = malloc(numRuns * sizeof(long));
+  struct runblock *block = malloc(numRuns * sizeof(struct runblock));
+  int r;
 
-    if (numOfThreads-- > 0) {
+  //cut holds the keys of every run below low
+  for (r = 0; r < numRuns; r++) {
+    cut[r] = 0;
+    upTo[r] = RUNLENGTH(r);
+    block[r] = (struct runblock) {blocks + (long) r * mergeKeys, 0, 0};
+  }
+  while (low < high) {
+    long mid = (low + high) >> 1;
+    below = 0;
+    for (r = 0; r < numRuns; r++)
+      below += position[r] = search_run(r, cut[r], upTo[r], mid, true, &block[r]);
+    if (below >= rank) high = mid; else low = mid + 1;
+    memcpy((below >= rank)? upTo : cut, position, numRuns * sizeof(long));
+  }
 
-      struct sort_args args = {array, left, j-1};
+  //Take the keys equal to low from the first runs until there are rank keys
+  below = 0;
+  for (r = 0; r < numRuns; r++)
+    below += cut[r];
+  for (r = 0; r < numRuns && below < rank; r++) {
+    long take = (rank - below < upTo[r] - cut[r])? rank - below : upTo[r] - cut[r];
+    cut[r] += take;
+    below += take;
+  }
+  free(upTo); free(position); free(block);
+}
 
-      pthread_t thread;
+/* Loser tree over k runs: node n > 0 holds the loser of the match between its children,
+   the leaves k..2k-1 are the runs and loser[0] holds the overall winner. Plays the
+   matches below node n and returns their winner */
+int play_loser_tree(int *loser, long *head, int k, int n){
+  if (n >= k) return n - k;
 
-      //sort the left part of the array, i.e. the part to the left side of the pivot j
-      pthread_create(&thread, 0, start_sort, &args);
+  int left = play_loser_tree(loser, head, k, 2 * n), right = play_loser_tree(loser, head, k, 2 * n + 1);
+  if (head[right] < head[left]) {
+    loser[n] = left;
+    return right;
+  }
+  loser[n] = right;
+  return left;
+}
 
-      //sort(array, left, j-1);
+void *merge_runs(void *arg){
+  long myid = (long) arg;
+  long out = totalKeys * myid / numWorkers, last = totalKeys * (myid + 1) / numWorkers;
+  long *next = malloc(numRuns * sizeof(long)), *end = malloc(numRuns * sizeof(long));
+  long *head = malloc(numRuns * sizeof(long));      /* next key of every run, LONG_MAX when done */
+  int *buffered = malloc(numRuns * sizeof(int)), *used = malloc(numRuns * sizeof(int));
+  int *loser = malloc(numRuns * sizeof(int));
+  int *in = malloc((size_t) numRuns * mergeKeys * sizeof(int)), *output = malloc(mergeKeys * sizeof(int));
+  int k = numRuns, filled = 0, r;
 
-      //sort the right part of the array, i.e. the part to the rght side of the pivot j
-      sort(array, j+1, right);
+  if (out == last) goto done;
+  cut_runs(out, next, in);
+  cut_runs(last, end, in);
 
-      pthread_join(thread, NULL);
+  //Refill the buffer of run r and take its next key
+  #define ADVANCE(r)                                                                         \
+    {                                                                                        \
+      if (used[r] == buffered[r] && next[r] < end[r]) {                                      \
+        buffered[r] = (end[r] - next[r] < mergeKeys)? end[r] - next[r] : mergeKeys;          \
+        transfer(runsFd, in + (long) (r) * mergeKeys, buffered[r] * sizeof(int),             \
+                 ((r) * runKeys + next[r]) * sizeof(int), false);                            \
+        next[r] += buffered[r];                                                              \
+        used[r] = 0;                                                                         \
+      }                                                                                      \
+      head[r] = (used[r] < buffered[r])? in[(long) (r) * mergeKeys + used[r]++] : LONG_MAX;  \
     }
-    else{
-      sort(array, left, j-1);
-      sort(array, j+1, right);
+  for (r = 0; r < k; r++) {
+    buffered[r] = used[r] = 0;
+    ADVANCE(r);
+  }
+
+  loser[0] = play_loser_tree(loser, head, k, 1);
+
+  while (head[loser[0]] != LONG_MAX) {
+    int winner = loser[0];
+    output[filled++] = head[winner];
+    if (filled == mergeKeys) {
+      transfer(outputFd, output, filled * sizeof(int), out * sizeof(int), true);
+      out += filled;
+      filled = 0;
+    }
+    ADVANCE(winner);
+    for (int n = (winner + k) / 2; n > 0; n /= 2) {
+      if (head[loser[n]] < head[winner]) {
+        int temp = loser[n];
+        loser[n] = winner;
+        winner = temp;
+      }
     }
+    loser[0] = winner;
   }
+  #undef ADVANCE
+  transfer(outputFd, output, filled * sizeof(int), out * sizeof(int), true);
+
+done:
+  free(next); free(end); free(head); free(buffered); free(used); free(loser); free(in); free(output);
+  return NULL;
+}
+
+//Method for sorting the keys of input into output with memory megabytes of buffers
+int external_sort(const char *input, const char *output, long memory){
+  char runsPath[4096];
+  struct stat info;
+
+  if (memory < 1) {
+    printf("The external sort needs at least 1 MB of memory\n");
+    return 1;
+  }
+  inputFd = open(input, O_RDONLY);
+  if (inputFd < 0 || fstat(inputFd, &info) < 0) {
+    perror(input);
+    return 1;
+  }
+  snprintf(runsPath, sizeof(runsPath), "%s.runs", output);
+  runsFd = open(runsPath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  outputFd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (runsFd < 0 || outputFd < 0) {
+    perror(output);
+    return 1;
+  }
+  posix_fadvise(inputFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  totalKeys = info.st_size / sizeof(int);
+  if (totalKeys == 0) {
+    printf("%s has no keys\n", input);
+    unlink(runsPath);
+    return 0;
+  }
+  runKeys = memory * 1024 * 1024 / (2 * sizeof(int));
+  if (runKeys > INT_MAX) runKeys = INT_MAX;
+  numRuns = (totalKeys + runKeys - 1) / runKeys;
+  if (numRuns == 1) runKeys = totalKeys;
+  for (int c = 0; c < 2; c++) {
+    chunks[c].keys = malloc(runKeys * sizeof(int));
+    chunks[c].full = false;
+  }
+  double megabytes = totalKeys * sizeof(int) / 1e6;
+
+  printf("Sorting %ld keys in %d runs of %ld with %d workers and the %s engine\n",
+         totalKeys, numRuns, runKeys, numWorkers, engineNames[engine]);
+  start_time = read_timer();
+  generate_runs();
+  double runTime = read_timer() - start_time;
+  printf("Run generation %g sec, %g MB/s (%g sec waiting for reads)\n", runTime, megabytes / runTime, readWait);
+
+  //The run buffers are given back to the merge, one buffer per run and one for output per worker.
+  //A buffer keeps at least CUTBLOCK keys even with many runs, or the whole run when that is shorter
+  free(chunks[0].keys);
+  free(chunks[1].keys);
+  mergeKeys = memory * 1024 * 1024 / ((long) numWorkers * (numRuns + 1) * sizeof(int));
+  if (mergeKeys < CUTBLOCK) mergeKeys = CUTBLOCK;
+  if (mergeKeys > runKeys) mergeKeys = runKeys;
+
+  double mergeStart = read_timer();
+  run_workers(merge_runs);
+  end_time = read_timer();
+  printf("Merge %g sec, %g MB/s\n", end_time - mergeStart, megabytes / (end_time - mergeStart));
+  printf("The execution time is %g sec, %g MB/s\n", end_time - start_time, megabytes / (end_time - start_time));
+
+  close(inputFd);
+  close(runsFd);
+  close(outputFd);
+  unlink(runsPath);
+  return 0;
+}
+
+//Write size random keys to path, as the in-memory sort would generate them
+int save_keys(const char *path, long size){
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    perror(path);
+    return 1;
+  }
+  for (long i = 0; i < size; i++) {
+    int key = rand()%99;
+    fwrite(&key, sizeof(int), 1, file);
+  }
+  fclose(file);
+  return 0;
+}
+
+//Sort n keys with an engine for the benchmark, returns the workers it used
+int bench_sort(int e, int *keys, int n, int workers){
+  length = n;
+  numWorkers = (workers < MAXWORKERS)? workers : MAXWORKERS;
+  sort_with(e, keys);
+  return numWorkers;
 }
 
 int main(int argc, char const *argv[]) {
 
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+    init_partition();
+    return sort_benchmark(argc, argv, engineNames, BOTH, bench_sort, read_timer);
+  }
+  if (argc > 3 && strcmp(argv[1], "save") == 0)
+    return save_keys(argv[2], atol(argv[3]));
+  if (argc > 3 && strcmp(argv[1], "external") == 0) {
+    numWorkers = (argc > 5)? atoi(argv[5]) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (numWorkers < 1) numWorkers = 1;
+    if (numWorkers > MAXWORKERS) numWorkers = MAXWORKERS;
+    if (argc > 6) {
+      for (engine = QUICK; engine < BOTH && strcmp(argv[6], engineNames[engine]) != 0; engine++);
+      if (engine == BOTH) {
+        printf("Unknown engine %s, use quick, radix, sample or merge\n", argv[6]);
+        return 1;
+      }
+    }
+    init_partition();
+    return external_sort(argv[2], argv[3], (argc > 4)? atol(argv[4]) : EXTERNALMEMORY);
+  }
+
   length = (argc > 1)? atoi(argv[1]) : MAXLENGTH;
+  numWorkers = (argc > 2)? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+  if (numWorkers < 1) numWorkers = 1;
+  if (numWorkers > MAXWORKERS) numWorkers = MAXWORKERS;
+  bool kernelBenchmark = argc > 3 && strcmp(argv[3], "kernels") == 0;
+  if (argc > 3 && !kernelBenchmark) {
+    for (engine = QUICK; engine <= BOTH && strcmp(argv[3], engineNames[engine]) != 0; engine++);
+    if (engine > BOTH) {
+      printf("Unknown engine %s, use quick, radix, sample, merge or both\n", argv[3]);
+      return 1;
+    }
+  }
 
   int *array = calloc(length, sizeof(int));
 
@@ -138,6 +1200,13 @@ int main(int argc, char const *argv[]) {
     array[i] = rand()%99;
   }
 
+  init_partition();
+  if (kernelBenchmark) {
+    benchmark_kernels(array, length);
+    free(array);
+    return 0;
+  }
+
   //Print array before sort
   #ifdef DEBUG
   printf("\n");
@@ -147,13 +1216,32 @@ int main(int argc, char const *argv[]) {
   printf("\n\n");
   #endif
 
-  start_time = read_timer();
+  if (engine == BOTH) {
 
-  /*struct sort_args init = {array, 0, length - 1};
-  start_sort(&init);*/
-  sort(array, 0, length - 1);
+    //Both engines sort copies of the same array so that their times can be compared
+    int *copy = malloc(length * sizeof(int));
+    memcpy(copy, array, length * sizeof(int));
 
-  end_time = read_timer();
+    start_time = read_timer();
+    sort_with(QUICK, array);
+    end_time = read_timer();
+    double quick_time = end_time - start_time;
+
+    start_time = read_timer();
+    sort_with(RADIX, copy);
+    end_time = read_timer();
+
+    printf("\nThe quicksort time is %g sec\n", quick_time);
+    printf("The radix sort time is %g sec (%.2fx)\n", end_time - start_time, quick_time / (end_time - start_time));
+    if (memcmp(array, copy, length * sizeof(int)) != 0)
+      printf("The engines disagree\n");
+    free(copy);
+  }
+  else {
+    start_time = read_timer();
+    sort_with(engine, array);
+    end_time = read_timer();
+  }
 
   //Print array after sort
   #ifdef DEBUG
@@ -163,7 +1251,8 @@ int main(int argc, char const *argv[]) {
   #endif
 
   printf("\n\n");
-  printf("The execution time is %g sec\n", end_time - start_time);
+  if (engine != BOTH)
+    printf("The execution time is %g sec\n", end_time - start_time);
 
   printf("\n");
 
@@ -0,0 +1,518 @@
+/*Partitions and benchmarks arrays of ints, shared by the pthreads and the OpenMP quicksort
+
+   features: the partition kernels of both sorts and the code around them.
+
+               choose_pivot(array, left, right, &duplicates)
+                                   median-of-3, or Tukey's ninther above NINTHER
+                                   keys, and whether the pivot key was sampled twice
+               partition(array, left, right, &lower, &upper)
+                                   three way partition around such a pivot
+               partitionKernel(array, first, last, pivot)
+                                   two way partition by the fastest kernel the
+                                   cpu has: branchless BlockQuicksort blocks of
+                                   PARTITIONBLOCK keys, or AVX2/AVX-512 ones.
+                                   init_partition() picks it once at startup.
+               benchmark_kernels(array, n)
+                                   times every kernel on a copy of the array
+
+             and the "bench" mode of both programs.
+
+               fill_keys(array, n, distribution)
+                                   uniform, sorted, reverse, few-unique, organ-pipe
+                                   or Zipf keys, the same for every run
+               checksum(array, n, &sum, &xor), is_sorted(array, n)
+                                   what a sort must keep and what it must produce
+               sort_benchmark(argc, argv, engines, numEngines, sort, timer)
+                                   times every engine on every distribution, size
+                                   and worker count and prints CSV lines
+
+             The input loops run in parallel when compiled with OpenMP.
+
+   usage:
+     #include "sortKernels.h"
+     init_partition();
+     ...
+     int lower, upper;
+     partition(array, left, right, &lower, &upper);
+     ...
+     return sort_benchmark(argc, argv, engineNames, BOTH, bench_sort, read_timer);
+*/
+#ifndef SORTKERNELS_H
+#define SORTKERNELS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#include <x86intrin.h>
+#endif
+
+#define NINTHER 40         /* ranges larger than this pick the pivot as a ninther */
+#define PARTITIONBLOCK 128 /* keys per block of the branchless partition */
+#define KERNELRUNS 5       /* runs per partition kernel in the benchmark, the fastest counts */
+#define BENCHMAX 32        /* sizes or worker counts the benchmark takes */
+#define BENCHRUNS 5        /* default timed runs per benchmark line */
+#define WARMUPRUNS 1       /* untimed runs before them */
+#define ZIPFKEYS 1000000   /* distinct keys of the Zipf distribution */
+#define BENCHSEED 0x5eed   /* seed of the benchmark inputs */
+
+//Swap two elemnets in an array
+static void swap(int array[], int i, int j){
+  int temp = array[i];
+  array[i] = array[j];
+  array[j] = temp;
+}
+
+//Cycle counter for the kernel benchmark, nanoseconds where there is none
+#if defined(__x86_64__) || defined(__i386__)
+#define CYCLEUNIT "cycles"
+static double read_cycles(){
+  return (double) __rdtsc();
+}
+#else
+#define CYCLEUNIT "ns"
+static double read_cycles(){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1e9 + now.tv_nsec;
+}
+#endif
+
+//Index of the median of three elements
+static int median3(int *array, int a, int b, int c){
+  if (array[a] < array[b])
+    return (array[b] < array[c])? b : (array[a] < array[c])? c : a;
+  return (array[a] < array[c])? a : (array[b] < array[c])? c : b;
+}
+
+//Pick the pivot: median of first, middle and last element, or for larger ranges the
+//median of three such medians (Tukey's ninther). Returns its index, and if duplicates
+//isn't NULL whether the pivot key was sampled more than once
+static int choose_pivot(int *array, int left, int right, bool *duplicates){
+  int n = right - left + 1, mid = left + n / 2, s = n / 8;
+  int samples[9] = {left, mid, right}, numSamples = 3, pivot, equal = 0;
+
+  if (n > NINTHER) {
+    int ninther[9] = {left, left + s, left + 2 * s, mid - s, mid, mid + s, right - 2 * s, right - s, right};
+    pivot = median3(array,
+                    median3(array, ninther[0], ninther[1], ninther[2]),
+                    median3(array, ninther[3], ninther[4], ninther[5]),
+                    median3(array, ninther[6], ninther[7], ninther[8]));
+    memcpy(samples, ninther, sizeof(ninther));
+    numSamples = 9;
+  }
+  else
+    pivot = median3(array, left, mid, right);
+
+  if (duplicates) {
+    for (int k = 0; k < numSamples; k++)
+      equal += array[samples[k]] == array[pivot];
+    *duplicates = equal > 1;
+  }
+  return pivot;
+}
+
+/* Partition kernels: put the elements of [first, last) that are less than the pivot first
+   and return where the others start.
+     lomuto   swaps every element and only moves the boundary on a comparison, no branches
+     block    BlockQuicksort (Edelkamp and Weiss): records the offsets of misplaced elements
+              in a block at each end without branching, then swaps them in pairs
+     avx2     compares 8 keys at once and moves the smaller to the front of the register
+              with a permutation table, then stores it at both ends of the free space
+     avx512   compares 16 keys at once and compress stores each side to its end
+   The vector kernels read from the end with less free space, so a store never covers
+   keys that haven't been read */
+static int partition_lomuto(int *array, int first, int last, int pivot){
+  int boundary = first;
+
+  for (int i = first; i < last; i++) {
+    int key = array[i];
+    array[i] = array[boundary];
+    array[boundary] = key;
+    boundary += key < pivot;
+  }
+  return boundary;
+}
+
+static int partition_branchless(int *array, int first, int last, int pivot){
+  unsigned char offsetsLeft[PARTITIONBLOCK], offsetsRight[PARTITIONBLOCK];
+  int numLeft = 0, numRight = 0, startLeft = 0, startRight = 0;
+  int l = first, r = last - 1, i;
+
+  //[first, l) is less than the pivot and (r, last) isn't
+  while (r - l + 1 >= 2 * PARTITIONBLOCK) {
+    if (numLeft == 0) {
+      startLeft = 0;
+      for (i = 0; i < PARTITIONBLOCK; i++) {
+        offsetsLeft[numLeft] = i;
+        numLeft += array[l + i] >= pivot;
+      }
+    }
+    if (numRight == 0) {
+      startRight = 0;
+      for (i = 0; i < PARTITIONBLOCK; i++) {
+        offsetsRight[numRight] = i;
+        numRight += array[r - i] < pivot;
+      }
+    }
+    int num = (numLeft < numRight)? numLeft : numRight;
+    for (i = 0; i < num; i++)
+      swap(array, l + offsetsLeft[startLeft + i], r - offsetsRight[startRight + i]);
+    numLeft -= num;
+    numRight -= num;
+    startLeft += num;
+    startRight += num;
+    if (numLeft == 0) l += PARTITIONBLOCK;
+    if (numRight == 0) r -= PARTITIONBLOCK;
+  }
+  return partition_lomuto(array, l, r + 1, pivot);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+int permutations[256][8];   /* lanes of the avx2 comparison mask first, the others after */
+
+//Place the keys left between the reads, they are fewer than a register
+#define PARTITION_TAIL(width)                                        \
+  {                                                                  \
+    int tail[width], n = readRight - readLeft;                       \
+    memcpy(tail, array + readLeft, n * sizeof(int));                 \
+    for (int k = 0; k < n; k++) {                                    \
+      if (tail[k] < pivot) array[writeLeft++] = tail[k];             \
+      else array[--writeRight] = tail[k];                            \
+    }                                                                \
+  }
+
+__attribute__((target("avx2")))
+static int partition_avx2(int *array, int first, int last, int pivot){
+  if (last - first < 4 * 8) return partition_branchless(array, first, last, pivot);
+
+  __m256i vpivot = _mm256_set1_epi32(pivot);
+  __m256i savedLeft = _mm256_loadu_si256((__m256i *) (array + first));
+  __m256i savedRight = _mm256_loadu_si256((__m256i *) (array + last - 8));
+  int readLeft = first + 8, readRight = last - 8, writeLeft = first, writeRight = last;
+
+  #define PARTITION8(v)                                                                      \
+    {                                                                                        \
+      int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(vpivot, v)));    \
+      __m256i sorted = _mm256_permutevar8x32_epi32(v, _mm256_loadu_si256((__m256i *) permutations[mask])); \
+      _mm256_storeu_si256((__m256i *) (array + writeLeft), sorted);                          \
+      _mm256_storeu_si256((__m256i *) (array + writeRight - 8), sorted);                     \
+      writeLeft += __builtin_popcount(mask);                                                 \
+      writeRight -= 8 - __builtin_popcount(mask);                                            \
+    }
+  while (readRight - readLeft >= 8) {
+    __m256i v;
+    if (readLeft - writeLeft <= writeRight - readRight) {
+      v = _mm256_loadu_si256((__m256i *) (array + readLeft));
+      readLeft += 8;
+    }
+    else {
+      readRight -= 8;
+      v = _mm256_loadu_si256((__m256i *) (array + readRight));
+    }
+    PARTITION8(v);
+  }
+  PARTITION_TAIL(8);
+  PARTITION8(savedLeft);
+  PARTITION8(savedRight);
+  #undef PARTITION8
+  return writeLeft;
+}
+
+__attribute__((target("avx512f")))
+static int partition_avx512(int *array, int first, int last, int pivot){
+  if (last - first < 4 * 16) return partition_branchless(array, first, last, pivot);
+
+  __m512i vpivot = _mm512_set1_epi32(pivot);
+  __m512i savedLeft = _mm512_loadu_si512(array + first);
+  __m512i savedRight = _mm512_loadu_si512(array + last - 16);
+  int readLeft = first + 16, readRight = last - 16, writeLeft = first, writeRight = last;
+
+  #define PARTITION16(v)                                                                     \
+    {                                                                                        \
+      __mmask16 less = _mm512_cmplt_epi32_mask(v, vpivot);                                   \
+      int count = __builtin_popcount(less);                                                  \
+      _mm512_mask_compressstoreu_epi32(array + writeLeft, less, v);                          \
+      writeLeft += count;                                                                    \
+      writeRight -= 16 - count;                                                              \
+      _mm512_mask_compressstoreu_epi32(array + writeRight, (__mmask16) ~less, v);            \
+    }
+  while (readRight - readLeft >= 16) {
+    __m512i v;
+    if (readLeft - writeLeft <= writeRight - readRight) {
+      v = _mm512_loadu_si512(array + readLeft);
+      readLeft += 16;
+    }
+    else {
+      readRight -= 16;
+      v = _mm512_loadu_si512(array + readRight);
+    }
+    PARTITION16(v);
+  }
+  PARTITION_TAIL(16);
+  PARTITION16(savedLeft);
+  PARTITION16(savedRight);
+  #undef PARTITION16
+  return writeLeft;
+}
+#endif
+
+/* the partition kernel, picked once at startup for the cpu we run on */
+int (*partitionKernel)(int *array, int first, int last, int pivot) = partition_branchless;
+const char *partitionName = "block";
+
+static void init_partition(){
+#if defined(__x86_64__) || defined(__i386__)
+  for (int mask = 0; mask < 256; mask++) {
+    int lane = 0;
+    for (int k = 0; k < 8; k++) if (mask & (1 << k)) permutations[mask][lane++] = k;
+    for (int k = 0; k < 8; k++) if (!(mask & (1 << k))) permutations[mask][lane++] = k;
+  }
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    partitionKernel = partition_avx512; partitionName = "avx512";
+  } else if (__builtin_cpu_supports("avx2")) {
+    partitionKernel = partition_avx2; partitionName = "avx2";
+  }
+#endif
+}
+
+//Method for partitioning in three parts. Afterwards the elements in [left, *lower) are less
+//than the pivot, [*lower, *upper] equal to it and (*upper, right] greater or equal. The keys
+//equal to the pivot are only gathered by a second pass when the samples saw it twice, which
+//keeps runs of duplicates from degenerating the recursion
+static void partition(int *array, int left, int right, int *lower, int *upper){
+  bool duplicates;
+  int p = choose_pivot(array, left, right, &duplicates), pivot = array[p];
+
+  swap(array, left, p);
+  int boundary = partitionKernel(array, left + 1, right + 1, pivot);
+  swap(array, left, boundary - 1);
+  *lower = boundary - 1;
+
+  if (!duplicates) *upper = boundary - 1;
+  else if (pivot == INT_MAX) *upper = right;
+  else *upper = partitionKernel(array, boundary, right + 1, pivot + 1) - 1;
+}
+
+//Time every partition kernel the cpu has on a copy of the n keys of array, in cycles per element
+static void benchmark_kernels(int *array, int n){
+  struct { const char *name; int (*kernel)(int *, int, int, int); } kernels[4] = {
+    {"lomuto", partition_lomuto}, {"block", partition_branchless}};
+  int numKernels = 2;
+  int *copy = malloc(n * sizeof(int));
+
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("avx2")) {
+    kernels[numKernels].name = "avx2";
+    kernels[numKernels++].kernel = partition_avx2;
+  }
+  if (__builtin_cpu_supports("avx512f")) {
+    kernels[numKernels].name = "avx512";
+    kernels[numKernels++].kernel = partition_avx512;
+  }
+#endif
+  int pivot = array[choose_pivot(array, 0, n - 1, NULL)];
+
+  printf("Partitioning %d keys around %d, the sort uses %s\n", n, pivot, partitionName);
+  for (int k = 0; k < numKernels; k++) {
+    double best = 1e30;
+    int boundary = 0;
+    bool correct = true;
+
+    for (int run = 0; run < KERNELRUNS; run++) {
+      memcpy(copy, array, n * sizeof(int));
+      double cycles = read_cycles();
+      boundary = kernels[k].kernel(copy, 0, n, pivot);
+      cycles = read_cycles() - cycles;
+      if (cycles < best) best = cycles;
+    }
+    for (int i = 0; i < n; i++)
+      correct &= (i < boundary)? copy[i] < pivot : copy[i] >= pivot;
+    printf("%-8s %6.2f %s per element%s\n", kernels[k].name, best / n, CYCLEUNIT,
+           correct? "" : ", WRONG PARTITION");
+  }
+  free(copy);
+}
+
+/* Benchmark inputs: uniform, sorted, reverse, few-unique (99 keys), organ-pipe and Zipf keys,
+   regenerated from BENCHSEED for every size. Without OpenMP the loops run serially */
+enum distribution {UNIFORM, SORTED, REVERSE, FEWUNIQUE, ORGANPIPE, ZIPF};
+const char *distributionNames[] = {"uniform", "sorted", "reverse", "few-unique", "organ-pipe", "zipf"};
+double *zipfTable;    /* cumulative probability of the ZIPFKEYS Zipf keys */
+
+//splitmix64: a counter based random number generator, so every input can be regenerated
+static uint64_t randomBits(uint64_t counter){
+  uint64_t z = BENCHSEED + counter*0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+//Fill array with n keys of a distribution
+static void fill_keys(int *array, long n, enum distribution d){
+  long i;
+
+  if (d == ZIPF && !zipfTable) {
+    double total = 0;
+    zipfTable = malloc(ZIPFKEYS * sizeof(double));
+    for (i = 0; i < ZIPFKEYS; i++) zipfTable[i] = total += 1.0 / (i + 1);
+    for (i = 0; i < ZIPFKEYS; i++) zipfTable[i] /= total;
+  }
+
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(static)
+#endif
+  for (i = 0; i < n; i++) {
+    uint64_t bits = randomBits(i);
+    switch (d) {
+      case UNIFORM:   array[i] = (int) (bits >> 32); break;
+      case SORTED:    array[i] = i; break;
+      case REVERSE:   array[i] = n - i; break;
+      case FEWUNIQUE: array[i] = bits % 99; break;
+      case ORGANPIPE: array[i] = (i < n / 2)? i : n - i; break;
+      case ZIPF: {
+        //Inverse of the cumulative distribution by binary search
+        double u = (bits >> 11) * 0x1.0p-53;
+        int low = 0, high = ZIPFKEYS - 1;
+        while (low < high) {
+          int mid = (low + high) / 2;
+          if (zipfTable[mid] < u) low = mid + 1; else high = mid;
+        }
+        array[i] = low;
+        break;
+      }
+    }
+  }
+}
+
+//Sum and xor of the keys, which a sort must keep
+static void checksum(int *array, long n, uint64_t *sum, uint64_t *xor){
+  uint64_t s = 0, x = 0;
+  long i;
+
+#ifdef _OPENMP
+  #pragma omp parallel for reduction(+:s) reduction(^:x) schedule(static)
+#endif
+  for (i = 0; i < n; i++) {
+    s += (uint32_t) array[i];
+    x ^= (uint32_t) array[i] * 0x9e3779b97f4a7c15ULL;
+  }
+  *sum = s;
+  *xor = x;
+}
+
+//Whether the keys are in ascending order
+static bool is_sorted(int *array, long n){
+  long i, unsorted = 0;
+
+#ifdef _OPENMP
+  #pragma omp parallel for reduction(+:unsorted) schedule(static)
+#endif
+  for (i = 1; i < n; i++)
+    unsorted += array[i - 1] > array[i];
+  return unsorted == 0;
+}
+
+static int compare_doubles(const void *a, const void *b){
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+//Parse a comma separated list of positive numbers, returns how many there were
+static int parse_list(const char *text, long *values, int max){
+  int count = 0;
+  while (*text && count < max) {
+    values[count] = atol(text);
+    if (values[count] > 0) count++;
+    text = strchr(text, ',');
+    if (!text) break;
+    text++;
+  }
+  return count;
+}
+
+//Time the percentile p of sorted times, interpolated between neighbours
+static double percentile(double *times, int runs, double p){
+  double at = p * (runs - 1);
+  int below = (int) at;
+  if (below + 1 >= runs) return times[runs - 1];
+  return times[below] + (at - below) * (times[below + 1] - times[below]);
+}
+
+/* Benchmark driver. Every engine sorts every distribution at every size and worker count,
+   first WARMUPRUNS untimed and then a number of timed runs. Each run is checked: the
+   output must be sorted and have the same sum and xor of keys as the input. One CSV
+   line is printed per engine, distribution, size and worker count.
+   sort(engine, keys, n, workers) sorts the n keys with an engine on that many workers and
+   returns how many it used, timer() returns seconds */
+static int sort_benchmark(int argc, char const *argv[], const char *engines[], int numEngines,
+                          int (*sort)(int engine, int *keys, int n, int workers), double (*timer)(void)){
+  long sizes[BENCHMAX], workers[BENCHMAX];
+  int numSizes = parse_list((argc > 2)? argv[2] : "100000,1000000", sizes, BENCHMAX);
+  int numCounts = argc > 3? parse_list(argv[3], workers, BENCHMAX) : 0;
+  int runs = (argc > 4)? atoi(argv[4]) : BENCHRUNS;
+  long maxSize = 0;
+  int z;
+
+  if (numCounts == 0) {
+    workers[numCounts++] = 1;
+    if (sysconf(_SC_NPROCESSORS_ONLN) > 1) workers[numCounts++] = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (runs < 1) runs = 1;
+  for (z = 0; z < numSizes; z++)
+    if (sizes[z] > maxSize) maxSize = sizes[z];
+
+  int *input = malloc(maxSize * sizeof(int)), *keys = malloc(maxSize * sizeof(int));
+  double *times = malloc(runs * sizeof(double));
+
+  printf("engine,distribution,size,threads,runs,min_sec,p10_sec,median_sec,p90_sec,max_sec,mkeys_per_sec,verified\n");
+  for (z = 0; z < numSizes; z++) {
+    for (int d = UNIFORM; d <= ZIPF; d++) {
+      uint64_t sum, xor;
+      int n = sizes[z];
+      fill_keys(input, n, d);
+      checksum(input, n, &sum, &xor);
+
+      for (int w = 0; w < numCounts; w++) {
+        for (int e = 0; e < numEngines; e++) {
+          bool verified = true;
+          int used = 0;
+
+          for (int run = -WARMUPRUNS; run < runs; run++) {
+            uint64_t sortedSum, sortedXor;
+            memcpy(keys, input, n * sizeof(int));
+            double start = timer();
+            used = sort(e, keys, n, workers[w]);
+            double time = timer() - start;
+            if (run >= 0) times[run] = time;
+
+            checksum(keys, n, &sortedSum, &sortedXor);
+            verified &= is_sorted(keys, n) && sortedSum == sum && sortedXor == xor;
+          }
+
+          qsort(times, runs, sizeof(double), compare_doubles);
+          printf("%s,%s,%d,%d,%d,%g,%g,%g,%g,%g,%g,%s\n", engines[e], distributionNames[d],
+                 n, used, runs, times[0], percentile(times, runs, 0.1),
+                 percentile(times, runs, 0.5), percentile(times, runs, 0.9), times[runs - 1],
+                 n / percentile(times, runs, 0.5) / 1e6, verified? "yes" : "NO");
+          fflush(stdout);
+        }
+      }
+    }
+  }
+  free(input);
+  free(keys);
+  free(times);
+  free(zipfTable);
+  zipfTable = NULL;
+  return 0;
+}
+
+#endif
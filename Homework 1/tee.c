@@ -2,62 +2,209 @@
 
    features: reads from a file specified as the first argument when running the code
              and writes to standard output and a specified file specified as the second
-             argument when running the code.
+             argument when running the code. "-" as the first argument reads standard input.
+
+             The data is moved by the kernel without being copied through user space:
+             tee(2) duplicates the input pipe into the standard output pipe and splice(2)
+             moves the input into the file. An input that isn't a pipe is spliced into a
+             pipe of our own first, an output that isn't a pipe is fed from a second one.
+             A destination that can't be spliced to (a terminal) is written from the
+             pipe with read/write instead.
+
+             When the input can't be spliced at all, it is read in BUFFERSIZE chunks and
+             a second thread writes each chunk to the file while the main thread writes
+             it to standard output.
 
    usage under Linux:
      gcc tee.c -o tee -lpthread
      ./tee file1 file2
+     producer | ./tee - file2 | consumer
 */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <pthread.h>
+#include <sys/stat.h>
 
-FILE *fp, *fp2;
+#define PIPESIZE (1 << 20)     /* bytes we ask the kernel to let a pipe hold */
+#define BUFFERSIZE (1 << 20)   /* bytes per read of the fallback */
 
-//Write content from buffer to file "tee.txt"
-void* writeFile(int buffer){
-  fputc(buffer, fp2);
-  return NULL;
+int in, out, file;             /* the input, standard output and the file */
+
+char *buffer;                  /* the chunk of the fallback both writers write */
+ssize_t bufferLength;
+pthread_barrier_t barrier;
+
+//Write all n bytes, exits on an error
+void write_all(int fd, const char *data, ssize_t n){
+  while (n > 0) {
+    ssize_t written = write(fd, data, n);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      perror("write");
+      exit(1);
+    }
+    data += written;
+    n -= written;
+  }
 }
 
-//Write content from buffer to standard output
-void* printText(int buffer){
-  printf("%c", buffer);
-  return NULL;
+bool is_pipe(int fd){
+  struct stat st;
+  return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
 }
 
-int main(int argc, char *argv[]) {
+//Move n bytes out of a pipe into fd. If fd can't be spliced to, *splices is cleared and
+//the bytes are read and written instead
+void drain(int pipe, int fd, ssize_t n, bool *splices){
+  while (n > 0) {
+    ssize_t moved;
+    if (*splices) {
+      moved = splice(pipe, NULL, fd, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (moved < 0 && errno == EINVAL) {
+        *splices = false;
+        continue;
+      }
+    }
+    else {
+      moved = read(pipe, buffer, (n < BUFFERSIZE)? n : BUFFERSIZE);
+      if (moved > 0) write_all(fd, buffer, moved);
+    }
+    if (moved < 0) {
+      if (errno == EINTR) continue;
+      perror("splice");
+      exit(1);
+    }
+    n -= moved;
+  }
+}
 
-    printf("\n");
+//Make a pipe and ask for a large one, a pipe of the default size is fine as well
+void make_pipe(int ends[2]){
+  if (pipe(ends) < 0) {
+    perror("pipe");
+    exit(1);
+  }
+  fcntl(ends[1], F_SETPIPE_SZ, PIPESIZE);
+}
 
-  //Check that the user has specified two arguments: a fileto read from and a file to write to.
-  if(argc != 3){
-    printf("ERROR: You must specify a file to be read from and a file to write to\n");
-    exit(0);
+//Copy the input without it passing through user space. Returns false, having moved nothing,
+//if the input can't be spliced
+bool splice_tee(){
+  int source[2] = {in, -1}, sink[2] = {-1, out};
+  bool outSplices = true, fileSplices = true, first = true;
+
+  if (!is_pipe(in)) make_pipe(source);
+  if (!is_pipe(out)) make_pipe(sink);
+
+  for (;;) {
+    ssize_t n = PIPESIZE;
+
+    //Fill our own pipe from the input
+    if (source[0] != in) {
+      n = splice(in, NULL, source[1], NULL, PIPESIZE, SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0 && errno == EINVAL && first) {
+        close(source[0]);
+        close(source[1]);
+        if (sink[0] >= 0) { close(sink[0]); close(sink[1]); }
+        return false;
+      }
+      if (n < 0) {
+        perror("splice");
+        exit(1);
+      }
+      if (n == 0) break;
+    }
+    first = false;
+
+    //Duplicate what is in the pipe to the output side, then move the same bytes to the file.
+    //tee may duplicate less than the pipe holds, so the file takes exactly what it duplicated.
+    //An input pipe is duplicated until its writers are gone, our own pipe until it is empty
+    for (;;) {
+      ssize_t duplicated = tee(source[0], sink[1], n, 0);
+      if (duplicated < 0) {
+        if (errno == EINTR) continue;
+        perror("tee");
+        exit(1);
+      }
+      if (duplicated == 0) break;
+
+      drain(source[0], file, duplicated, &fileSplices);
+      if (sink[0] >= 0) drain(sink[0], out, duplicated, &outSplices);
+      if (source[0] != in && (n -= duplicated) == 0) break;
+    }
+    if (source[0] == in) break;
+  }
+
+  if (source[0] != in) { close(source[0]); close(source[1]); }
+  if (sink[0] >= 0) { close(sink[0]); close(sink[1]); }
+  return true;
+}
+
+//Write every chunk of the buffer to the file while the main thread writes it to standard output
+void* writeFile(void *arg){
+  (void) arg;
+  for (;;) {
+    pthread_barrier_wait(&barrier);
+    if (bufferLength <= 0) break;
+    write_all(file, buffer, bufferLength);
+    pthread_barrier_wait(&barrier);
   }
+  return NULL;
+}
 
-  int buffer;
-  fp = fopen(argv[1], "r");
-  fp2 = fopen(argv[2], "w");
+//Copy the input with read and write through a large buffer
+void read_write(){
   pthread_t thread1;
-  pthread_t thread2;
 
-  //As long as we are not at the end of the file
-  while (!feof(fp)) {
+  pthread_barrier_init(&barrier, NULL, 2);
+  pthread_create(&thread1, 0, writeFile, NULL);
 
-    //Read from file and place in buffer
-    buffer = fgetc(fp);
+  for (;;) {
+    do bufferLength = read(in, buffer, BUFFERSIZE); while (bufferLength < 0 && errno == EINTR);
+    if (bufferLength < 0) perror("read");
+    pthread_barrier_wait(&barrier);
+    if (bufferLength <= 0) break;
+    write_all(out, buffer, bufferLength);
+    pthread_barrier_wait(&barrier);
+  }
 
-    //Create thread to write to file
-    pthread_create(&thread1, 0, writeFile, (void*)buffer);
+  pthread_join(thread1, NULL);
+  pthread_barrier_destroy(&barrier);
+}
 
-    //Create thread to write to standard output
-    pthread_create(&thread2, 0, printText, (void*)buffer);
+int main(int argc, char *argv[]) {
+
+  //Check that the user has specified two arguments: a fileto read from and a file to write to.
+  if(argc != 3){
+    printf("ERROR: You must specify a file to be read from and a file to write to\n");
+    exit(0);
+  }
+
+  in = (strcmp(argv[1], "-") == 0)? STDIN_FILENO : open(argv[1], O_RDONLY);
+  if (in < 0) {
+    perror(argv[1]);
+    exit(1);
+  }
+  file = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (file < 0) {
+    perror(argv[2]);
+    exit(1);
   }
+  out = STDOUT_FILENO;
+  buffer = malloc(BUFFERSIZE);
 
-  printf("\n");
+  if (!splice_tee())
+    read_write();
 
-  fclose(fp);
-  fclose(fp2);
+  free(buffer);
+  close(in);
+  close(file);
+  return 0;
 }
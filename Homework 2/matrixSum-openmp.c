@@ -4,9 +4,29 @@ PROGRAM DESCRIPTION
 =================================================================================================================
 Matrix summation using OpenMP
 
+   Each row is summed by an SSE4.1, AVX2 or AVX-512 kernel picked at startup
+   (scalar fallback on other cpus) that finds the min and max in the same pass.
+
+   The element type is int by default; compile with -DELEMENT_INT8, -DELEMENT_INT16,
+   -DELEMENT_INT64, -DELEMENT_FLOAT or -DELEMENT_DOUBLE for other types. These use
+   a generic kernel that the compiler vectorizes at -O3. Integer sums are 64 bit,
+   floating point sums use Kahan summation.
+
+   The matrix is filled in parallel from a counter based random number generator,
+   so it does not depend on the number of threads. Run with OMP_PROC_BIND=true to
+   keep the threads next to the rows they initialized.
+
+   The element type, the allocation and the row kernels come from matrixReduce.h
+   in Homework 1, which the pthreads version includes as well.
+
    usage with gcc (version 4.2 or higher required):
-     gcc -O -fopenmp -o matrixSum-openmp matrixSum-openmp.c
+     gcc -O3 -fopenmp -o matrixSum-openmp matrixSum-openmp.c
      ./matrixSum-openmp size numWorkers
+
+   size is either n for an n x n matrix or rowsxcolumns, e.g. 5000x20000.
+   The matrix is allocated with mmap at the requested size and backed by
+   transparent huge pages; compile with -DEXPLICIT_HUGEPAGES to use the
+   hugetlbfs pool (vm.nr_hugepages) when it has enough pages.
 =================================================================================================================
 PERFORMANCE MEASUREMENT:
 =================================================================================================================
@@ -45,77 +65,98 @@ double start_time, end_time;
 
 #include <stdio.h>
 #include <stdlib.h>
-#define MAXSIZE 10000  /* maximum matrix size */
+
+//The element type, the matrix and the row kernels are shared with the pthreads version
+#include "../Homework 1/matrixReduce.h"
+
+#define MAXSIZE 10000  /* default matrix size */
 #define MAXWORKERS 10   /* maximum number of workers */
+#define CACHELINE 64    /* size of a cache line in bytes */
 //#define DEBUG
 
 int numWorkers;
-int size;
-int matrix[MAXSIZE][MAXSIZE];
 void *Worker(void *);
 
+//Is position a before position b in row major order
+int before(struct position a, struct position b) {
+  return a.yPos < b.yPos || (a.yPos == b.yPos && a.xPos < b.xPos);
+}
+
+//The smaller value wins, on equal values the first one in the matrix wins
+struct position minOf(struct position a, struct position b) {
+  return (b.value < a.value || (b.value == a.value && before(b, a))) ? b : a;
+}
+
+//The larger value wins, on equal values the first one in the matrix wins
+struct position maxOf(struct position a, struct position b) {
+  return (b.value > a.value || (b.value == a.value && before(b, a))) ? b : a;
+}
+
+//Every thread keeps its own min and max, they are combined once when the loop ends.
+//The private copies start from the original variable, which is an element of the matrix
+#pragma omp declare reduction(minloc : struct position : omp_out = minOf(omp_out, omp_in)) initializer(omp_priv = omp_orig)
+#pragma omp declare reduction(maxloc : struct position : omp_out = maxOf(omp_out, omp_in)) initializer(omp_priv = omp_orig)
+#pragma omp declare reduction(sum : struct accumulator : accumulate(&omp_out, omp_in.sum - omp_in.compensation)) initializer(omp_priv = { 0, 0 })
+
 /* read command line, initialize, and create threads */
 int main(int argc, char *argv[]) {
-  int i, j, max, min, maxX, maxY, minX, minY, total=0;
+  int i, j;
+  struct accumulator total = { 0, 0 };
+  struct position min, max;
 
   /* read command line args if any */
-  size = (argc > 1)? atoi(argv[1]) : MAXSIZE;
+  rows = cols = MAXSIZE;
+  if (argc > 1) parseSize(argv[1]);
   numWorkers = (argc > 2)? atoi(argv[2]) : MAXWORKERS;
-  if (size > MAXSIZE) size = MAXSIZE;
   if (numWorkers > MAXWORKERS) numWorkers = MAXWORKERS;
 
   omp_set_num_threads(numWorkers);
+  initReduceRow();
+
+  /* allocate the matrix, every row is padded to a whole number of cache lines */
+  stride = (cols + CACHELINE/sizeof(elem_t) - 1) / (CACHELINE/sizeof(elem_t)) * (CACHELINE/sizeof(elem_t));
+  matrix = allocMatrix(rows*stride*sizeof(elem_t));
 
   /* initialize the matrix */
-  for (i = 0; i < size; i++) {
-    for (j = 0; j < size; j++) {
-      matrix[i][j] = rand()%99;
+  //Uses the same static schedule as the summation below, so every thread first touches
+  //the rows it sums later and their pages are placed on its numa node
+#pragma omp parallel for schedule(static) private(j)
+  for (i = 0; i < rows; i++) {
+    for (j = 0; j < cols; j++) {
+      ROW(i)[j] = randomBits((uint64_t) i*cols + j) % 99;
 	  }
   }
 
   /* print the matrix */
 #ifdef DEBUG
-  for (i = 0; i < size; i++) {
+  for (i = 0; i < rows; i++) {
 	  printf("[ ");
-	  for (j = 0; j < size; j++) {
-	    printf(" %d", matrix[i][j]);
+	  for (j = 0; j < cols; j++) {
+	    printf(" " PRINT_FMT, (print_t) ROW(i)[j]);
 	  }
 	  printf(" ]\n");
   }
 #endif
 
-  min = max = matrix[0][0];
+  min.value = ROW(0)[0];
+  min.xPos = min.yPos = 0;
+  max = min;
 
   start_time = omp_get_wtime();
 
   //i is private automatically as we use an omp parallel for
-#pragma omp parallel for reduction (+:total) private(j)
-    for (i = 0; i < size; i++){
-      for (j = 0; j < size; j++){
-        total += matrix[i][j];
-
-        //Check of statement is true outside the loop so that we don't enter the critical section when we don't have to. This increases performance considerably.
-        if (matrix[i][j] < min) {
-          #pragma omp critical
-          {
-            if (matrix[i][j] < min) {
-              min = matrix[i][j];
-              minX= j;
-              minY = i;
-            }
-          }
-        }
-        if (matrix[i][j] > max){
-          #pragma omp critical
-          {
-            if (matrix[i][j] > max) {
-              max = matrix[i][j];
-              maxX = j;
-              maxY = i;
-            }
-          }
-        }
-      }
+  //min and max are reduced like total, so there are no critical sections in the loop
+#pragma omp parallel for schedule(static) reduction (sum:total) reduction (minloc:min) reduction (maxloc:max)
+    for (i = 0; i < rows; i++){
+      //The whole row is reduced by the vectorized kernel, so we compare once per row instead of once per element
+      struct rowresult row;
+      reduceRow(ROW(i), cols, &row);
+      accumulate(&total, row.sum);
+
+      struct position rowMin = { row.min, row.minPos, i };
+      struct position rowMax = { row.max, row.maxPos, i };
+      min = minOf(min, rowMin);
+      max = maxOf(max, rowMax);
     }
 
 // implicit barrier
@@ -123,9 +164,9 @@ int main(int argc, char *argv[]) {
   end_time = omp_get_wtime();
   printf("\n");
     /* print results */
-  printf("The total is %d\n", total);
-  printf("The minimum is %d, x = %d, y = %d\n", min, minX, minY);
-  printf("The minimum is %d, x = %d, y = %d\n", max, maxX, maxY);
+  printf("The total is " PRINT_FMT "\n", (print_t) total.sum);
+  printf("The minimum is " PRINT_FMT ", x = %d, y = %d\n", (print_t) min.value, min.xPos, min.yPos);
+  printf("The maximum is " PRINT_FMT ", x = %d, y = %d\n", (print_t) max.value, max.xPos, max.yPos);
   printf("The execution time is %g sec\n", end_time - start_time);
   printf("\n");
 }
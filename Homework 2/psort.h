@@ -0,0 +1,240 @@
+/*
+=========================================================================================================
+PROGRAM DESCRIPTION
+=========================================================================================================
+Generic parallel sort for any element type
+
+   features: PSORT_DEFINE(name, type, keytype, KEY, LESS) writes a parallel
+             quicksort for arrays of type. KEY(p) gives the key of the
+             element p points to and LESS(a, b) compares two keys, both are
+             macros so the comparison is inlined in every instantiation.
+
+               name_sort(type *array, long n)
+                 sorts the elements in place with OpenMP tasks (branchless
+                 block partitions with a pass for keys equal to a duplicated
+                 pivot, median-of-3 or ninther pivots, insertion sort below
+                 PSORT_INSERTIONCUTOFF, no tasks below PSORT_TASKCUTOFF).
+
+               name_sort_indirect(type *array, long n)
+                 for large records: sorts (key, index) entries instead, so
+                 partitioning moves 16 bytes per element rather than the whole
+                 record, and then gathers the records in order in parallel.
+
+             The sort is not stable. Call it from outside a parallel region.
+
+   usage:
+     #include "psort.h"
+     struct record { double key; char payload[48]; };
+     #define RECORD_KEY(r) ((r)->key)
+     PSORT_DEFINE(records, struct record, double, RECORD_KEY, PSORT_LESS)
+     ...
+     records_sort_indirect(array, n);
+
+     compile with -fopenmp
+=========================================================================================================
+*/
+#ifndef PSORT_H
+#define PSORT_H
+
+#include <omp.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef PSORT_TASKCUTOFF
+#define PSORT_TASKCUTOFF 4096       /* ranges up to this size are sorted without tasks */
+#endif
+#ifndef PSORT_INSERTIONCUTOFF
+#define PSORT_INSERTIONCUTOFF 16    /* ranges up to this size are insertion sorted */
+#endif
+
+#ifndef PSORT_BLOCK
+#define PSORT_BLOCK 128             /* keys per block of the branchless partition, at most 256 */
+#endif
+#ifndef PSORT_NINTHER
+#define PSORT_NINTHER 40            /* ranges above this size take a ninther pivot */
+#endif
+
+#define PSORT_LESS(a, b) ((a) < (b))
+
+//The in place sort for one element type, name_sort
+#define PSORT_DEFINE_INPLACE(name, type, keytype, KEY, LESS)                                   \
+                                                                                               \
+static inline void name##_swap(type *array, long i, long j){                                   \
+  type temp = array[i];                                                                        \
+  array[i] = array[j];                                                                         \
+  array[j] = temp;                                                                             \
+}                                                                                              \
+                                                                                               \
+static inline void name##_insertion(type *array, long left, long right){                       \
+  for (long i = left + 1; i <= right; i++) {                                                   \
+    type element = array[i];                                                                   \
+    long j = i;                                                                                \
+    while (j > left && LESS(KEY(&element), KEY(&array[j - 1]))) {                              \
+      array[j] = array[j - 1];                                                                 \
+      j--;                                                                                     \
+    }                                                                                          \
+    array[j] = element;                                                                        \
+  }                                                                                            \
+}                                                                                              \
+                                                                                               \
+static inline keytype name##_median3(keytype a, keytype b, keytype c){                         \
+  return LESS(a, b)? (LESS(b, c)? b : LESS(a, c)? c : a)                                       \
+                   : (LESS(a, c)? a : LESS(b, c)? c : b);                                      \
+}                                                                                              \
+                                                                                               \
+static inline int name##_equal(keytype a, keytype b){                                          \
+  return !LESS(a, b) && !LESS(b, a);                                                           \
+}                                                                                              \
+                                                                                               \
+/* Two-way partition around the median of the first, middle and last key, or for ranges        \
+   above PSORT_NINTHER keys the median of three such medians (Tukey's ninther), which keeps    \
+   inputs like organ-pipe from making every partition lopsided. Blocks of PSORT_BLOCK keys     \
+   from both ends are compared without branches first (BlockQuicksort), the keys that are      \
+   on the wrong side are then swapped pairwise, and a Hoare pass finishes the middle. When     \
+   another sample equals the pivot, a second pass gathers the keys equal to it between the     \
+   two sides so that duplicate keys don't degenerate the recursion. [lower, upper] holds       \
+   those keys, it is empty otherwise */                                                        \
+static inline void name##_partition(type *array, long left, long right, long *lower, long *upper){ \
+  long mid = left + (right - left) / 2, step = 0, l = left, r = right, i, k;                   \
+  int samples = 3, equal = 0;                                                                  \
+  keytype pivot = name##_median3(KEY(&array[left]), KEY(&array[mid]), KEY(&array[right]));     \
+  if (right - left + 1 > PSORT_NINTHER) {                                                      \
+    step = (right - left) / 8;                                                                 \
+    samples = 9;                                                                               \
+    keytype a = name##_median3(KEY(&array[left]), KEY(&array[left + step]),                    \
+                               KEY(&array[left + 2*step]));                                    \
+    keytype c = name##_median3(KEY(&array[right - 2*step]), KEY(&array[right - step]),         \
+                               KEY(&array[right]));                                            \
+    pivot = name##_median3(a, name##_median3(KEY(&array[mid - step]), KEY(&array[mid]),        \
+                                             KEY(&array[mid + step])), c);                     \
+  }                                                                                            \
+  long sample[9] = {left, mid, right, left + step, left + 2*step, mid - step, mid + step,      \
+                    right - 2*step, right - step};                                             \
+  for (int s = 0; s < samples; s++)                                                            \
+    equal += name##_equal(KEY(&array[sample[s]]), pivot);                                      \
+                                                                                               \
+  /* [left, l) holds keys not above the pivot and (r, right] keys not below it */              \
+  unsigned char leftOffsets[PSORT_BLOCK], rightOffsets[PSORT_BLOCK];                           \
+  int numLeft = 0, numRight = 0, startLeft = 0, startRight = 0;                                \
+  while (r - l + 1 > 2 * PSORT_BLOCK) {                                                        \
+    if (numLeft == 0) {                                                                        \
+      startLeft = 0;                                                                           \
+      for (k = 0; k < PSORT_BLOCK; k++) {                                                      \
+        leftOffsets[numLeft] = k;                                                              \
+        numLeft += !LESS(KEY(&array[l + k]), pivot);                                           \
+      }                                                                                        \
+    }                                                                                          \
+    if (numRight == 0) {                                                                       \
+      startRight = 0;                                                                          \
+      for (k = 0; k < PSORT_BLOCK; k++) {                                                      \
+        rightOffsets[numRight] = k;                                                            \
+        numRight += !LESS(pivot, KEY(&array[r - k]));                                          \
+      }                                                                                        \
+    }                                                                                          \
+    int n = (numLeft < numRight)? numLeft : numRight;                                          \
+    for (k = 0; k < n; k++)                                                                    \
+      name##_swap(array, l + leftOffsets[startLeft + k], r - rightOffsets[startRight + k]);    \
+    numLeft -= n;                                                                              \
+    numRight -= n;                                                                             \
+    startLeft += n;                                                                            \
+    startRight += n;                                                                           \
+    if (numLeft == 0) l += PSORT_BLOCK;                                                        \
+    if (numRight == 0) r -= PSORT_BLOCK;                                                       \
+  }                                                                                            \
+  for (i = l, k = r;;) {                                                                       \
+    while (i <= k && LESS(KEY(&array[i]), pivot)) i++;                                         \
+    while (i <= k && LESS(pivot, KEY(&array[k]))) k--;                                         \
+    if (i >= k) break;                                                                         \
+    name##_swap(array, i++, k--);                                                              \
+  }                                                                                            \
+                                                                                               \
+  /* [left, k] and [k + 1, right] are the two sides. One is empty if every key not below the   \
+     pivot went left or every key not above it went right, then the keys equal to the pivot    \
+     are gathered as well, there is at least one */                                            \
+  *lower = k + 1;                                                                              \
+  *upper = k;                                                                                  \
+  if (equal > 1 || k < left || k >= right) {                                                   \
+    long j = k;                                                                                \
+    for (i = k = j; i >= left; i--)                                                            \
+      if (!LESS(KEY(&array[i]), pivot)) name##_swap(array, i, k--);                            \
+    *lower = k + 1;                                                                            \
+    for (i = k = j + 1; i <= right; i++)                                                       \
+      if (!LESS(pivot, KEY(&array[i]))) name##_swap(array, i, k++);                            \
+    *upper = k - 1;                                                                            \
+  }                                                                                            \
+}                                                                                              \
+                                                                                               \
+static inline void name##_serial(type *array, long left, long right){                          \
+  long lower, upper;                                                                           \
+                                                                                               \
+  while (right - left + 1 > PSORT_INSERTIONCUTOFF) {                                           \
+    name##_partition(array, left, right, &lower, &upper);                                      \
+    if (lower - left < right - upper) {                                                        \
+      name##_serial(array, left, lower - 1);                                                   \
+      left = upper + 1;                                                                        \
+    }                                                                                          \
+    else {                                                                                     \
+      name##_serial(array, upper + 1, right);                                                  \
+      right = lower - 1;                                                                       \
+    }                                                                                          \
+  }                                                                                            \
+  if (right > left) name##_insertion(array, left, right);                                      \
+}                                                                                              \
+                                                                                               \
+static inline void name##_task(type *array, long left, long right){                            \
+  long lower, upper;                                                                           \
+                                                                                               \
+  while (right - left + 1 > PSORT_TASKCUTOFF) {                                                \
+    name##_partition(array, left, right, &lower, &upper);                                      \
+    long first = left, last = lower - 1;                                                       \
+    _Pragma("omp task firstprivate(first, last)")                                              \
+    name##_task(array, first, last);                                                           \
+    left = upper + 1;                                                                          \
+  }                                                                                            \
+  name##_serial(array, left, right);                                                           \
+}                                                                                              \
+                                                                                               \
+static inline void name##_sort(type *array, long n){                                           \
+  _Pragma("omp parallel")                                                                      \
+  _Pragma("omp single nowait")                                                                 \
+  name##_task(array, 0, n - 1);                                                                \
+}
+
+//name_sort for the elements themselves and name_sort_indirect through (key, index) entries
+#define PSORT_DEFINE(name, type, keytype, KEY, LESS)                                           \
+                                                                                               \
+PSORT_DEFINE_INPLACE(name, type, keytype, KEY, LESS)                                           \
+                                                                                               \
+struct name##_entry {                                                                          \
+  keytype key;                                                                                 \
+  long index;                                                                                  \
+};                                                                                             \
+                                                                                               \
+PSORT_DEFINE_INPLACE(name##_entries, struct name##_entry, keytype, PSORT_ENTRYKEY, LESS)       \
+                                                                                               \
+static inline void name##_sort_indirect(type *array, long n){                                  \
+  struct name##_entry *entries = malloc(n * sizeof(struct name##_entry));                      \
+  type *sorted = malloc(n * sizeof(type));                                                     \
+  long i;                                                                                      \
+                                                                                               \
+  _Pragma("omp parallel for schedule(static)")                                                 \
+  for (i = 0; i < n; i++) {                                                                    \
+    entries[i].key = KEY(&array[i]);                                                           \
+    entries[i].index = i;                                                                      \
+  }                                                                                            \
+  name##_entries_sort(entries, n);                                                             \
+                                                                                               \
+  _Pragma("omp parallel for schedule(static)")                                                 \
+  for (i = 0; i < n; i++)                                                                      \
+    sorted[i] = array[entries[i].index];                                                       \
+  _Pragma("omp parallel for schedule(static)")                                                 \
+  for (i = 0; i < n; i++)                                                                      \
+    array[i] = sorted[i];                                                                      \
+                                                                                               \
+  free(entries);                                                                               \
+  free(sorted);                                                                                \
+}
+
+#define PSORT_ENTRYKEY(e) ((e)->key)
+
+#endif
@@ -8,9 +8,54 @@ Sorts an array of random numbers
              with random numbers. The array is of the size specified when
              running the code.
 
+             Partitions split around a median-of-3 (ninther for larger ranges)
+             pivot with a branchless BlockQuicksort kernel, or an AVX2/AVX-512 one
+             picked at startup. A second pass gathers the keys equal to the pivot
+             when the samples show it is duplicated, so duplicate keys don't
+             degenerate the recursion. "kernels" times every kernel on the array.
+             The pivot choice, the kernels and the benchmark driver below come
+             from sortKernels.h in Homework 1, which the pthreads version
+             includes as well.
+             When all keys fall in a range smaller than COUNTRANGE (and the array)
+             the array is counting sorted in parallel instead.
+
+             The top levels, ranges above PARALLELCUTOFF and a 1/4 thread share of
+             the array, are partitioned by all threads together: each partitions
+             its own block, then the misplaced elements are swapped across the
+             boundary in parallel.
+
+             Below the top levels the left side of every partition becomes a task
+             until ranges reach taskCutoff, then they are sorted serially. Ranges
+             up to insertionCutoff are insertion sorted, those of at most
+             NETWORKMAX elements by a sorting network. Unless the cutoffs are
+             given, an autotune pass picks them at startup by timing candidates
+             on uniform random keys. The sample and merge engines only tune the
+             insertion cutoff, the others use neither.
+
+             The radix engine is an LSD radix sort instead, with per thread digit
+             histograms and a scatter through write combining buffers. The digit
+             width adapts to the range of the keys. "both" sorts copies of the
+             same array with each engine and compares the times.
+
+             The sample engine buckets the keys by oversampled splitters in one
+             pass and each thread sorts one bucket. The merge engine has every
+             thread sort its share and then merge an equal part of the output
+             out of all shares. Neither has a serial top level.
+
+             The generic engine sorts the keys with the type generic sort from
+             psort.h, the records engine sorts them as records with a 48 byte
+             payload through its key/index path.
+
+             "bench" runs every engine over uniform, sorted, reverse, few-unique
+             (99 keys), organ-pipe and Zipf inputs for the given sizes and thread
+             counts, with a warmup run, and prints min, p10, median, p90 and max
+             times as CSV after checking each output is a sorted permutation.
+
    usage under Linux:
      gcc qsort_openmp.c -o qsort_openmp -fopenmp
-     ./qsort_openmp size numWorkers
+     ./qsort_openmp size numWorkers kernels
+     ./qsort_openmp size numWorkers [quick|radix|sample|merge|generic|records|both] [taskCutoff [insertionCutoff]]
+     ./qsort_openmp bench [size,size,... [threads,threads,... [runs]]] > results.csv
 =========================================================================================================
 PERFORMANCE MEASUREMENT:
 =========================================================================================================
@@ -46,76 +91,712 @@ Number of threads         1         2         3         4         5         mean
 #include <omp.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <ctype.h>
 #include <stdbool.h>
+#include <limits.h>
+#include <stdint.h>
 #include <time.h>
 #include <sys/time.h>
+#include "psort.h"
+#include "../Homework 1/sortKernels.h"
 
 #define MAXLENGTH 1300000
 #define MAXWORKERS 10
+#define COUNTRANGE 65536 /* arrays with fewer distinct key values than this are counting sorted */
+#define PARALLELCUTOFF 262144 /* ranges larger than this may be partitioned by all threads together */
+#define INSERTIONCUTOFF 16     /* default insertion sort cutoff when only a task cutoff is given */
+#define NETWORKMAX 8           /* largest range sorted by a sorting network */
+#define AUTOTUNESIZE 262144    /* elements sorted by every autotune run */
+#define AUTOTUNERUNS 3         /* runs per candidate, the fastest counts */
+#define RADIXBITS 11           /* widest radix sort digit */
+#define COMBINESIZE 16         /* keys buffered per digit before they are written, one cache line */
+#define CACHELINE 64
+#define OVERSAMPLE 64          /* samples per sample sort bucket */
+#define RECORDPAYLOAD 48       /* payload bytes of the records engine */
+#define TASKCUTOFF 4096        /* task cutoff of the benchmark, which doesn't autotune */
 //#define DEBUG
 
 int length;
 int numWorkers;
 
+enum sortengine {QUICK, RADIX, SAMPLE, MERGE, GENERIC, RECORDS, BOTH};
+const char *engineNames[] = {"quick", "radix", "sample", "merge", "generic", "records", "both"};
+enum sortengine engine = QUICK;
+
 double start_time, end_time; /* start and end times */
 
-//Swap two elemnets in an array
-void swap(int array[], int i, int j){
-  int temp = array[i];
-  array[i] = array[j];
-  array[j] = temp;
+/* Optimal sorting networks for 2 to NETWORKMAX elements, as pairs of positions to
+   compare and exchange. network[networkStart[n]] is the first pair for n elements */
+const unsigned char network[] = {
+  0,1,
+  0,1, 1,2, 0,1,
+  0,1, 2,3, 0,2, 1,3, 1,2,
+  0,3, 1,4, 0,2, 1,3, 0,1, 2,4, 1,2, 3,4, 2,3,
+  0,5, 1,3, 2,4, 1,2, 3,4, 0,3, 2,5, 0,1, 2,3, 4,5, 1,2, 3,4,
+  0,6, 2,3, 4,5, 0,2, 1,4, 3,6, 0,1, 2,5, 3,4, 1,2, 4,6, 2,3, 4,5, 1,2, 3,4, 5,6,
+  0,2, 1,3, 4,6, 5,7, 0,4, 1,5, 2,6, 3,7, 0,1, 2,3, 4,5, 6,7, 2,4, 3,5, 1,4, 3,6, 1,2, 3,4, 5,6
+};
+const int networkStart[NETWORKMAX + 2] = {0, 0, 0, 2, 8, 18, 36, 60, 92, 130};
+
+int taskCutoff;        /* ranges up to this size are sorted inside the task that found them */
+int insertionCutoff;   /* ranges up to this size are insertion sorted */
+
+//Sort a small range, by a sorting network when there is one for its size
+void small_sort(int *array, int left, int right){
+  int n = right - left + 1;
+  int *a = array + left;
+
+  if (n <= NETWORKMAX) {
+    for (int k = networkStart[n]; k < networkStart[n + 1]; k += 2) {
+      int x = a[network[k]], y = a[network[k + 1]];
+      a[network[k]] = (x < y)? x : y;
+      a[network[k + 1]] = (x < y)? y : x;
+    }
+    return;
+  }
+  for (int i = 1; i < n; i++) {
+    int key = a[i], j = i;
+    while (j > 0 && a[j - 1] > key) {
+      a[j] = a[j - 1];
+      j--;
+    }
+    a[j] = key;
+  }
+}
+
+//Method for sorting a range without tasks. Recurses into the smaller side only
+void serial_sort(int *array, int left, int right){
+  int lower, upper;
+
+  while (right - left + 1 > insertionCutoff) {
+    partition(array, left, right, &lower, &upper);
+    if (lower - left < right - upper) {
+      serial_sort(array, left, lower-1);
+      left = upper+1;
+    }
+    else {
+      serial_sort(array, upper+1, right);
+      right = lower-1;
+    }
+  }
+  if (right > left) small_sort(array, left, right);
 }
 
-//Method for partitioning
-int partition (int *array, int left, int right){
-  int i = left, j = right + 1;
-  while(1){
+//Method for sorting. This is the part that can be parallelized: the left side of every
+//partition becomes a task while the current task goes on with the right side, until the
+//range is small enough that a task isn't worth its overhead
+void sort(int *array, int left, int right){
+
+  while (right - left + 1 > taskCutoff) {
 
-    /*Note: need a do while loop as this will cause i++/j-- to be executed at least once before checking if the condition is met */
+    //Partition the elements in the array. [lower, upper] holds the elements equal to the pivot
+    int lower, upper;
+    partition(array, left, right, &lower, &upper);
+
+    #pragma omp task
+    {
+      sort(array, left, lower-1);
+    }
+    left = upper+1;
+  }
+  serial_sort(array, left, right);
+}
 
-    //while the element in position i is less than the pivot element, increment i
-    do i++; while(array[i] <= array[left] && i < right);
+//Sort a copy of sample with the current cutoffs, returns the best time of a few runs
+double time_sort(int *sample, int *copy, int n, bool parallel){
+  double best = 1e30;
 
-    //While the element in position j is greater than the pivot element, decrement j
-    do j--; while (array[j] > array[left]);
+  for (int run = 0; run < AUTOTUNERUNS; run++) {
+    for (int i = 0; i < n; i++) copy[i] = sample[i];
+    double start = omp_get_wtime();
+    if (parallel) {
+      #pragma omp parallel
+      #pragma omp single nowait
+      sort(copy, 0, n - 1);
+    }
+    else
+      serial_sort(copy, 0, n - 1);
+    double time = omp_get_wtime() - start;
+    if (time < best) best = time;
+  }
+  return best;
+}
 
-    //Check if pointers cross. In that case, we are done with the partitioning => break from the loop
-    if (i >= j) break;
+//Pick the cutoffs for this host by sorting uniform random keys with each candidate: the
+//insertion sort cutoff on one thread first, then the task cutoff with all threads if tasks.
+//The array itself could have few distinct keys, and those never reach the cutoffs
+void autotune(bool tasks){
+  static const int insertionCandidates[] = {8, 16, 32, 64};
+  static const int taskCandidates[] = {1024, 4096, 16384, 65536};
+  int n = (length < AUTOTUNESIZE)? length : AUTOTUNESIZE;
+  int *sample = malloc(n * sizeof(int)), *copy = malloc(n * sizeof(int));
+  double best;
+  int c;
 
-    //If the pointers hasn't crossed yet, swap their positions
-    swap(array, i, j);
+  for (c = 0; c < n; c++) sample[c] = rand();
+  taskCutoff = INT_MAX;
+  best = 1e30;
+  for (c = 0; c < 4; c++) {
+    int previous = insertionCutoff;
+    insertionCutoff = insertionCandidates[c];
+    double time = time_sort(sample, copy, n, false);
+    if (time < best) best = time;
+    else insertionCutoff = previous;
   }
-  //swap the pivot element with j.
-  swap(array, left, j);
 
-  //return index
-  return j;
+  best = 1e30;
+  for (c = 0; tasks && c < 4; c++) {
+    int previous = taskCutoff;
+    taskCutoff = taskCandidates[c];
+    double time = time_sort(sample, copy, n, true);
+    if (time < best) best = time;
+    else taskCutoff = previous;
+  }
+  free(sample);
+  free(copy);
 }
 
-//Method for sorting. This is the part that can be parallelized
-void sort(int *array, int left, int right){
+/* Parallel partition for the top levels of the sort, where a single partition would leave
+   the other threads idle. Every thread partitions its own block of the range, which leaves
+   large elements left of the final boundary and small ones right of it. Both kinds are
+   listed as one interval per block, and the threads then swap equal shares of them */
+struct interval {
+  int first, last;
+};
+
+//Find the element a number of places into a list of intervals
+void seek_interval(struct interval *list, long skip, int *index, int *position){
+  int l = 0;
+  while (skip >= list[l].last - list[l].first) {
+    skip -= list[l].last - list[l].first;
+    l++;
+  }
+  *index = l;
+  *position = list[l].first + (int) skip;
+}
 
-  if (right > left) {
+//Partition [left, right] with all threads, small means < pivot if strict and <= pivot
+//otherwise. Returns the first element that isn't small
+int parallel_partition(int *array, int left, int right, int pivot, bool strict){
+  int threads = omp_get_max_threads();
+  int *split = malloc(threads * sizeof(int));
+  struct interval *large = malloc(threads * sizeof(struct interval));
+  struct interval *small = malloc(threads * sizeof(struct interval));
+  int boundary = left;
+  long misplaced = 0;
 
-    //Partition the elements in the array. "j" is the index of the pivot element
-    int j = partition(array, left, right);
+  #pragma omp parallel num_threads(threads)
+  {
+    int id = omp_get_thread_num(), count = omp_get_num_threads();
+    #define BLOCKFIRST(id) (left + (int) ((long) (right + 1 - left) * (id) / count))
+    int i = BLOCKFIRST(id), j = BLOCKFIRST(id + 1) - 1;
 
-    #pragma omp task
+    while (1) {
+      while (i <= j && (strict? array[i] < pivot : array[i] <= pivot)) i++;
+      while (i <= j && !(strict? array[j] < pivot : array[j] <= pivot)) j--;
+      if (i >= j) break;
+      swap(array, i++, j--);
+    }
+    split[id] = i;
+
+    #pragma omp barrier
+    #pragma omp single
     {
-      sort(array, left, j-1);
+      int l;
+      for (l = 0; l < count; l++)
+        boundary += split[l] - BLOCKFIRST(l);
+      for (l = 0; l < count; l++) {
+        int first = BLOCKFIRST(l), end = BLOCKFIRST(l + 1);
+        large[l].first = split[l];
+        large[l].last = (end < boundary)? end : boundary;
+        if (large[l].last < large[l].first) large[l].last = large[l].first;
+        small[l].first = (first > boundary)? first : boundary;
+        small[l].last = split[l];
+        if (small[l].last < small[l].first) small[l].last = small[l].first;
+        misplaced += large[l].last - large[l].first;
+      }
     }
-    #pragma omp task
+    #undef BLOCKFIRST
+
+    //Swap my share of the misplaced elements
+    long first = misplaced * id / count, last = misplaced * (id + 1) / count;
+    if (first < last) {
+      int a, b;
+      seek_interval(large, first, &a, &i);
+      seek_interval(small, first, &b, &j);
+      for (long k = first; k < last; k++) {
+        while (i == large[a].last) i = large[++a].first;
+        while (j == small[b].last) j = small[++b].first;
+        swap(array, i++, j++);
+      }
+    }
+  }
+  free(split);
+  free(large);
+  free(small);
+  return boundary;
+}
+
+//Ranges left over by the parallel partitions, each becomes a task
+struct range {
+  int left, right;
+};
+struct range *topRanges;
+int numTopRanges, maxTopRanges;
+
+//Partition the top levels in parallel until the ranges are at most threshold long
+void partition_top(int *array, int left, int right, int threshold){
+  if (right < left) return;
+
+  if (right - left + 1 <= threshold) {
+    if (numTopRanges == maxTopRanges) {
+      maxTopRanges = maxTopRanges? 2 * maxTopRanges : 64;
+      topRanges = realloc(topRanges, maxTopRanges * sizeof(struct range));
+    }
+    topRanges[numTopRanges].left = left;
+    topRanges[numTopRanges++].right = right;
+    return;
+  }
+
+  //Three-way split in two passes: < pivot first, then == pivot out of the rest
+  int pivot = array[choose_pivot(array, left, right, NULL)];
+  int lower = parallel_partition(array, left, right, pivot, true);
+  int upper = parallel_partition(array, lower, right, pivot, false) - 1;
+
+  partition_top(array, left, lower-1, threshold);
+  partition_top(array, upper+1, right, threshold);
+}
+
+/* Counting sort for arrays whose keys span a small range. The threads count their
+   share of the array into private histograms, the histograms are summed into key
+   offsets and every thread writes its own slice of the output. Returns false, without
+   touching the array, when the keys span COUNTRANGE values or more */
+bool counting_sort(int *array, long n){
+  int min = INT_MAX, max = INT_MIN;
+  long i;
+
+  #pragma omp parallel for reduction(min:min) reduction(max:max) schedule(static)
+  for (i = 0; i < n; i++) {
+    if (array[i] < min) min = array[i];
+    if (array[i] > max) max = array[i];
+  }
+  if (n < 2 || (long) max - min >= COUNTRANGE || (long) max - min >= n)
+    return false;
+
+  int numKeys = max - min + 1;
+  long *offsets = calloc(numKeys + 1, sizeof(long));
+
+  #pragma omp parallel
+  {
+    long *counts = calloc(numKeys, sizeof(long));
+    long k;
+
+    #pragma omp for schedule(static)
+    for (i = 0; i < n; i++)
+      counts[array[i] - min]++;
+    for (k = 0; k < numKeys; k++) {
+      if (counts[k]) {
+        #pragma omp atomic
+        offsets[k + 1] += counts[k];
+      }
+    }
+    free(counts);
+
+    #pragma omp barrier
+    #pragma omp single
+    for (k = 0; k < numKeys; k++)
+      offsets[k + 1] += offsets[k];
+
+    //Write my slice of the output, starting with the key that covers its first position
+    int threads = omp_get_num_threads(), id = omp_get_thread_num();
+    long first = n * id / threads, last = n * (id + 1) / threads;
+    int key = 0, high = numKeys;
+    while (key + 1 < high) {
+      int mid = (key + high) / 2;
+      if (offsets[mid] <= first) key = mid; else high = mid;
+    }
+    for (long p = first; p < last; key++) {
+      long end = (offsets[key + 1] < last)? offsets[key + 1] : last;
+      for (; p < end; p++)
+        array[p] = min + key;
+    }
+  }
+  free(offsets);
+  return true;
+}
+
+/* LSD radix sort. The keys are taken relative to the smallest one, and the digit width
+   is the one that covers their bits in the fewest passes of at most RADIXBITS bits. Every
+   pass counts the digits of each thread's share into a private histogram, turns the
+   histograms into output positions (digit major, thread minor, so the sort is stable)
+   and scatters. The scatter goes through a cache line sized buffer per digit so that
+   the stores to the output are whole lines instead of single elements */
+void radix_sort(int *array, long n){
+  int min = INT_MAX, max = INT_MIN, bits = 0;
+  long i;
+
+  #pragma omp parallel for reduction(min:min) reduction(max:max) schedule(static)
+  for (i = 0; i < n; i++) {
+    if (array[i] < min) min = array[i];
+    if (array[i] > max) max = array[i];
+  }
+  while (bits < 32 && ((unsigned) max - (unsigned) min) >> bits) bits++;
+  if (n < 2 || bits == 0) return;
+
+  int passes = (bits + RADIXBITS - 1) / RADIXBITS;
+  int digitBits = (bits + passes - 1) / passes, numDigits = 1 << digitBits;
+  int threads = omp_get_max_threads();
+  int *source = array, *target = malloc(n * sizeof(int));
+  long *offsets = malloc((size_t) threads * numDigits * sizeof(long));
+
+  #pragma omp parallel num_threads(threads)
+  {
+    int id = omp_get_thread_num(), count = omp_get_num_threads();
+    long first = n * id / count, last = n * (id + 1) / count;
+    long *mine = offsets + (long) id * numDigits;
+    int *buffers = aligned_alloc(CACHELINE, (size_t) numDigits * COMBINESIZE * sizeof(int));
+    int *fill = malloc(numDigits * sizeof(int));
+    long i;
+    int d;
+
+    for (int shift = 0; shift < bits; shift += digitBits) {
+      #define DIGIT(key) ((((unsigned) (key) - (unsigned) min) >> shift) & (numDigits - 1))
+      for (d = 0; d < numDigits; d++) mine[d] = 0;
+      for (i = first; i < last; i++)
+        mine[DIGIT(source[i])]++;
+
+      #pragma omp barrier
+      #pragma omp single
+      {
+        long position = 0;
+        for (d = 0; d < numDigits; d++) {
+          for (int t = 0; t < count; t++) {
+            long digits = offsets[(long) t * numDigits + d];
+            offsets[(long) t * numDigits + d] = position;
+            position += digits;
+          }
+        }
+      }
+
+      for (d = 0; d < numDigits; d++) fill[d] = 0;
+      for (i = first; i < last; i++) {
+        int key = source[i];
+        d = DIGIT(key);
+        buffers[d * COMBINESIZE + fill[d]++] = key;
+        if (fill[d] == COMBINESIZE) {
+          memcpy(target + mine[d], buffers + d * COMBINESIZE, COMBINESIZE * sizeof(int));
+          mine[d] += COMBINESIZE;
+          fill[d] = 0;
+        }
+      }
+      for (d = 0; d < numDigits; d++)
+        memcpy(target + mine[d], buffers + d * COMBINESIZE, fill[d] * sizeof(int));
+      #undef DIGIT
+
+      #pragma omp barrier
+      #pragma omp single
+      {
+        int *swap = source;
+        source = target;
+        target = swap;
+      }
+    }
+    free(buffers);
+    free(fill);
+  }
+
+  //After an odd number of passes the sorted keys are in the scratch array
+  if (source != array) {
+    memcpy(array, source, n * sizeof(int));
+    target = source;
+  }
+  free(target);
+  free(offsets);
+}
+
+//First position in [first, last) whose key is not less than key, or greater than key if after
+long search(int *array, long first, long last, long key, bool after){
+  while (first < last) {
+    long mid = first + (last - first) / 2;
+    if (array[mid] < key || (after && array[mid] == key)) first = mid + 1;
+    else last = mid;
+  }
+  return first;
+}
+
+/* Sample sort. A sorted oversample of the keys gives one splitter less than there are
+   threads, each thread finds the bucket of every key in its share once, and the keys are
+   scattered into the buckets through the same per thread histogram prefix sums as the
+   radix sort. Thread b then sorts bucket b on its own and copies it back */
+void sample_sort(int *array, long n){
+  int threads = omp_get_max_threads();
+  int *splitters = malloc(threads * sizeof(int));
+  unsigned short *bucketOf = malloc(n * sizeof(unsigned short));
+  long *offsets = malloc((size_t) threads * threads * sizeof(long));
+  long *bucketStart = malloc((threads + 1) * sizeof(long));
+  int *scratch = malloc(n * sizeof(int));
+
+  #pragma omp parallel num_threads(threads)
+  {
+    int id = omp_get_thread_num(), count = omp_get_num_threads(), b;
+    long first = n * id / count, last = n * (id + 1) / count, i;
+    long *mine = offsets + (long) id * count;
+
+    //Pick the samples with a xorshift generator, so that rand() isn't disturbed
+    #pragma omp single
+    {
+      int samples = OVERSAMPLE * count;
+      int *sample = malloc(samples * sizeof(int));
+      uint64_t state = 0x9E3779B97F4A7C15;
+      for (int k = 0; k < samples; k++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        sample[k] = array[state % n];
+      }
+      serial_sort(sample, 0, samples - 1);
+      for (b = 1; b < count; b++)
+        splitters[b - 1] = sample[b * OVERSAMPLE];
+      free(sample);
+    }
+
+    for (b = 0; b < count; b++) mine[b] = 0;
+    for (i = first; i < last; i++) {
+      b = search(splitters, 0, count - 1, array[i], true);
+      bucketOf[i] = b;
+      mine[b]++;
+    }
+
+    #pragma omp barrier
+    #pragma omp single
     {
-      sort(array, j+1, right);
+      long position = 0;
+      for (int bucket = 0; bucket < count; bucket++) {
+        bucketStart[bucket] = position;
+        for (int t = 0; t < count; t++) {
+          long keys = offsets[(long) t * count + bucket];
+          offsets[(long) t * count + bucket] = position;
+          position += keys;
+        }
+      }
+      bucketStart[count] = position;
+    }
+
+    for (i = first; i < last; i++)
+      scratch[mine[bucketOf[i]]++] = array[i];
+
+    #pragma omp barrier
+    serial_sort(scratch, bucketStart[id], bucketStart[id + 1] - 1);
+    memcpy(array + bucketStart[id], scratch + bucketStart[id], (bucketStart[id + 1] - bucketStart[id]) * sizeof(int));
+  }
+  free(splitters);
+  free(bucketOf);
+  free(offsets);
+  free(bucketStart);
+  free(scratch);
+}
+
+/* Multiway merge sort. Every thread sorts its share, then the output is cut into equal
+   parts and thread k merges part k out of all the shares. The cut for a rank is found by
+   a binary search for the smallest key with at least rank keys at or below it, taking
+   keys equal to it from the shares in order so that the cuts of all parts agree */
+#define SHAREFIRST(s) (n * (s) / count)
+
+//Positions in every share that put rank keys before them
+void cut_shares(int *array, long n, int count, long rank, long *cut){
+  long low = INT_MIN, high = INT_MAX, below;
+  int s;
+
+  while (low < high) {
+    long mid = (low + high) >> 1;
+    below = 0;
+    for (s = 0; s < count; s++)
+      below += search(array, SHAREFIRST(s), SHAREFIRST(s + 1), mid, true) - SHAREFIRST(s);
+    if (below >= rank) high = mid; else low = mid + 1;
+  }
+
+  below = 0;
+  for (s = 0; s < count; s++) {
+    cut[s] = search(array, SHAREFIRST(s), SHAREFIRST(s + 1), low, false);
+    below += cut[s] - SHAREFIRST(s);
+  }
+  for (s = 0; s < count && below < rank; s++) {
+    long equal = search(array, cut[s], SHAREFIRST(s + 1), low, true) - cut[s];
+    long take = (rank - below < equal)? rank - below : equal;
+    cut[s] += take;
+    below += take;
+  }
+}
+
+void merge_sort(int *array, long n){
+  int *scratch = malloc(n * sizeof(int));
+
+  #pragma omp parallel
+  {
+    int id = omp_get_thread_num(), count = omp_get_num_threads();
+    long *first = malloc(count * sizeof(long)), *last = malloc(count * sizeof(long));
+    int *heap = malloc(count * sizeof(int));
+    int size = 0, s;
+    long out = SHAREFIRST(id);
+
+    serial_sort(array, SHAREFIRST(id), SHAREFIRST(id + 1) - 1);
+
+    #pragma omp barrier
+    cut_shares(array, n, count, SHAREFIRST(id), first);
+    cut_shares(array, n, count, SHAREFIRST(id + 1), last);
+
+    //Binary min heap of the shares, ordered by their next key
+    #define HEAD(h) array[first[heap[h]]]
+    for (s = 0; s < count; s++) {
+      if (first[s] == last[s]) continue;
+      int h = size++;
+      heap[h] = s;
+      while (h > 0 && HEAD(h) < HEAD((h - 1) / 2)) {
+        int parent = (h - 1) / 2, temp = heap[h];
+        heap[h] = heap[parent];
+        heap[parent] = temp;
+        h = parent;
+      }
     }
+    while (size > 0) {
+      s = heap[0];
+      scratch[out++] = array[first[s]++];
+      if (first[s] == last[s]) heap[0] = heap[--size];
+
+      int h = 0;
+      while (2 * h + 1 < size) {
+        int child = 2 * h + 1;
+        if (child + 1 < size && HEAD(child + 1) < HEAD(child)) child++;
+        if (HEAD(h) <= HEAD(child)) break;
+        int temp = heap[h];
+        heap[h] = heap[child];
+        heap[child] = temp;
+        h = child;
+      }
+    }
+    #undef HEAD
+
+    #pragma omp barrier
+    memcpy(array + SHAREFIRST(id), scratch + SHAREFIRST(id), (SHAREFIRST(id + 1) - SHAREFIRST(id)) * sizeof(int));
+    free(first);
+    free(last);
+    free(heap);
   }
+  free(scratch);
+}
+#undef SHAREFIRST
+
+//Method for quicksorting the whole array, keys from a small range are counted instead
+void quick_sort(int *array){
+  if (!counting_sort(array, length)) {
+
+    //Ranges above the threshold are partitioned by all threads, so that every thread
+    //has a range of its own from the start
+    int threshold = length / (4 * numWorkers);
+    if (numWorkers == 1) threshold = length;
+    else if (threshold < PARALLELCUTOFF) threshold = PARALLELCUTOFF;
+    numTopRanges = 0;
+    partition_top(array, 0, length - 1, threshold);
+
+    #pragma omp parallel
+    {
+      //Only one thread creates the tasks for the top level ranges.
+      #pragma omp single nowait
+      {
+        for (int r = 0; r < numTopRanges; r++) {
+          #pragma omp task
+          sort(array, topRanges[r].left, topRanges[r].right);
+        }
+      }
+    }
+    free(topRanges);
+    topRanges = NULL;
+    maxTopRanges = 0;
+  }
+}
+
+/* Instances of the generic sort: the plain keys, and records that carry a payload and
+   are sorted by a double key through the index path */
+#define INT_KEY(p) (*(p))
+PSORT_DEFINE(ints, int, int, INT_KEY, PSORT_LESS)
+
+struct record {
+  double key;
+  char payload[RECORDPAYLOAD];
+};
+#define RECORD_KEY(r) ((r)->key)
+PSORT_DEFINE(records, struct record, double, RECORD_KEY, PSORT_LESS)
+
+//Sort the keys as records whose payload holds a copy of the key, and check they stayed together
+void record_sort(int *array, long n){
+  struct record *records = malloc(n * sizeof(struct record));
+  long i;
+
+  for (i = 0; i < n; i++) {
+    records[i].key = array[i];
+    memset(records[i].payload, 0, RECORDPAYLOAD);
+    memcpy(records[i].payload, &array[i], sizeof(int));
+  }
+  records_sort_indirect(records, n);
+
+  for (i = 0; i < n; i++) {
+    memcpy(&array[i], records[i].payload, sizeof(int));
+    if (array[i] != records[i].key) {
+      printf("Record %ld lost its payload\n", i);
+      break;
+    }
+  }
+  free(records);
+}
+
+//Sort the whole array with one of the engines
+void sort_with(enum sortengine with, int *array){
+  if (with == QUICK) quick_sort(array);
+  else if (length < 2) return;
+  else if (with == RADIX) radix_sort(array, length);
+  else if (with == SAMPLE) sample_sort(array, length);
+  else if (with == GENERIC) ints_sort(array, length);
+  else if (with == RECORDS) record_sort(array, length);
+  else merge_sort(array, length);
+}
+
+//Sort n keys with an engine for the benchmark, returns the threads it used
+int bench_sort(int e, int *keys, int n, int threads){
+  length = n;
+  numWorkers = threads;
+  omp_set_num_threads(numWorkers);
+  sort_with(e, keys);
+  return numWorkers;
 }
 
 int main(int argc, char const *argv[]) {
 
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+    init_partition();
+    taskCutoff = TASKCUTOFF;
+    insertionCutoff = INSERTIONCUTOFF;
+    return sort_benchmark(argc, argv, engineNames, BOTH, bench_sort, omp_get_wtime);
+  }
+
   length = (argc > 1)? atoi(argv[1]) : MAXLENGTH;
   numWorkers = (argc > 2)? atoi(argv[2]) : MAXWORKERS;
 
+  //The engine is optional, the cutoffs follow it
+  int arg = 3;
+  bool kernelBenchmark = argc > arg && strcmp(argv[arg], "kernels") == 0;
+  if (kernelBenchmark) arg++;
+  else if (argc > arg && isalpha((unsigned char) argv[arg][0])) {
+    for (engine = QUICK; engine <= BOTH && strcmp(argv[arg], engineNames[engine]) != 0; engine++);
+    if (engine > BOTH) {
+      printf("Unknown engine %s, use quick, radix, sample, merge, generic, records or both\n", argv[arg]);
+      return 1;
+    }
+    arg++;
+  }
+  taskCutoff = (argc > arg)? atoi(argv[arg]) : 0;
+  insertionCutoff = (argc > arg + 1)? atoi(argv[arg + 1]) : INSERTIONCUTOFF;
+
   int *array = calloc(length, sizeof(int));
 
   //Fill the array with random values between 0 and 99
@@ -123,6 +804,13 @@ int main(int argc, char const *argv[]) {
     array[i] = rand()%99;
   }
 
+  init_partition();
+  if (kernelBenchmark) {
+    benchmark_kernels(array, length);
+    free(array);
+    return 0;
+  }
+
   //Print array before sort
   #ifdef DEBUG
   printf("\n");
@@ -134,17 +822,49 @@ int main(int argc, char const *argv[]) {
 
   omp_set_num_threads(numWorkers);
 
-  start_time = omp_get_wtime();
+  //Without a task cutoff on the command line the cutoffs the engine uses are tuned for this
+  //host: quicksort uses both, sample and merge sort their parts with serial_sort only
+  if (taskCutoff <= 0 && (engine == QUICK || engine == BOTH)) {
+    start_time = omp_get_wtime();
+    autotune(true);
+    end_time = omp_get_wtime();
+    printf("Autotune picked a task cutoff of %d and an insertion cutoff of %d in %g sec\n",
+           taskCutoff, insertionCutoff, end_time - start_time);
+  }
+  else if (taskCutoff <= 0 && (engine == SAMPLE || engine == MERGE)) {
+    start_time = omp_get_wtime();
+    autotune(false);
+    end_time = omp_get_wtime();
+    printf("Autotune picked an insertion cutoff of %d in %g sec\n", insertionCutoff, end_time - start_time);
+  }
+  if (insertionCutoff < 1) insertionCutoff = 1;
 
-  #pragma omp parallel
-  {
-    //Only one thread should call sort first time.
-    #pragma omp single nowait
-    {
-      sort(array, 0, length - 1);
-    }
+  if (engine == BOTH) {
+
+    //Both engines sort copies of the same array so that their times can be compared
+    int *copy = malloc(length * sizeof(int));
+    memcpy(copy, array, length * sizeof(int));
+
+    start_time = omp_get_wtime();
+    sort_with(QUICK, array);
+    end_time = omp_get_wtime();
+    double quick_time = end_time - start_time;
+
+    start_time = omp_get_wtime();
+    sort_with(RADIX, copy);
+    end_time = omp_get_wtime();
+
+    printf("\nThe quicksort time is %g sec\n", quick_time);
+    printf("The radix sort time is %g sec (%.2fx)\n", end_time - start_time, quick_time / (end_time - start_time));
+    if (memcmp(array, copy, length * sizeof(int)) != 0)
+      printf("The engines disagree\n");
+    free(copy);
+  }
+  else {
+    start_time = omp_get_wtime();
+    sort_with(engine, array);
+    end_time = omp_get_wtime();
   }
-  end_time = omp_get_wtime();
 
   //Print array after sort
   #ifdef DEBUG
@@ -154,7 +874,8 @@ int main(int argc, char const *argv[]) {
   #endif
 
   printf("\n\n");
-  printf("The execution time is %g sec\n", end_time - start_time);
+  if (engine != BOTH)
+    printf("The execution time is %g sec\n", end_time - start_time);
 
   printf("\n");
 